@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include "GBuild.h"
 #include <G64/G64.h>
 #include <stdio.h>
@@ -9,8 +10,16 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <setjmp.h>
+#include <sys/wait.h>
+#include <poll.h>
+#include <errno.h>
 
-const char *reserved[] = {"let", "if", "else", "cut", "lengthof", "uptime", "newer"};
+const char *reserved[] = {"let", "if", "else", "cut", "lengthof", "uptime", "newer", "stale", "filehash", "capture", "memo", "subdir", "remote", "remote_wait",
+	"replace", "find", "split", "startswith", "endswith", "basename", "dirname", "ext", "with_ext",
+	"fn", "pure", "return"};
 
 int IsReserved(const char *str)
 {
@@ -23,46 +32,360 @@ int IsReserved(const char *str)
 void ErrorHandler(LexState *l, int64_t tok)
 {
 	printf("GBuildFile:%d: error: Can't analyze %s token\n", l->line, GetTokenName(tok));
-	exit(1);
+	ScriptExit(1);
 }
 
 void ErrorHandle(LexState *l, const char *cause)
 {
 	printf("GBuildFile:%d: error: %s\n", l->line, cause);
-	exit(1);
+	ScriptExit(1);
+}
+
+// Errors that depend on runtime values can't be judged by the check pass,
+// so there this returns and the caller carries on with a harmless value
+void ValueError(LexState *l, const char *cause)
+{
+	if(!gb->checking)
+		ErrorHandle(l, cause);
+}
+
+// The check pass takes an unknown value for any type
+int TypeIs(Value *val, uint32_t type)
+{
+	return val->type == type || val->type == VT_UNKNOWN;
+}
+
+// Stands in for values the check pass can't know
+#define CHECK_PLACEHOLDER "placeholder"
+
+Variable *CheckPlaceholder(const char *name)
+{
+	Variable *var = calloc(1, sizeof(Variable));
+
+	var->name  = strdup(name);
+	var->value = ValueString(CHECK_PLACEHOLDER, strlen(CHECK_PLACEHOLDER));
+
+	VariableNew(var);
+
+	return var;
 }
 
 void PrsFactor();
 
 void PrsTerm();
 
+void PrsComparison();
+
 void PrsExpression();
 
+int PeekPair(int64_t token);
+
 void PrsStatement();
 
 void PrsBody();
 
+void SkipBody();
+
+typedef struct
+{
+	char     *name;
+	char    **params;
+	size_t    param_count;
+	LexState *body;
+	int       pure;
+	int       active;
+	HashMap  *results;
+} Function;
+
+Function *FunctionGet(const char *name);
+
+int PeekCall();
+
+void PrsCall(Function *fn);
+
 void PrsShell()
 {
 	Expect(TK_DOLLAR);
 
-	PrsExpression();
+	PrsComparison();
 
 	Value v = PopVal();
 
-	if(v.type != VT_STRING)
+	if(!TypeIs(&v, VT_STRING))
 		ErrorHandle(lex, "Can't execute a non-string value");
 
-	if(!AcceptB(TK_AND))
-		printf("%s\n", v.cur_str);
+	int quiet = !PeekPair(TK_AND) && AcceptB(TK_AND);
+
+	if(gb->checking) {
+		PushInt(0);
+		return;
+	}
+
+	if(gb->dry_run) {
+		printf("%s\n", ValueStr(&v));
+		gb->dry_run_count++;
+
+		PushInt(0);
+		return;
+	}
+
+	if(JournalReplay(ValueStr(&v))) {
+		if(!quiet)
+			printf("%s (resumed)\n", ValueStr(&v));
+
+		PushInt(0);
+		return;
+	}
+
+	if(!quiet)
+		printf("%s\n", ValueStr(&v));
 
-	int ret = system(v.cur_str);
+	int ret = RunCommand(ValueStr(&v));
 	if(ret == -1)
 		ret = 1;
 
+	JournalRecord(ValueStr(&v), ret);
+
 	PushInt(ret);
 }
 
+// Splits a space separated list of paths in place
+void PathList(char *list, char ***paths, size_t *count)
+{
+	size_t cap = 0;
+
+	char *save = NULL;
+
+	for(char *p = strtok_r(list, " ", &save); p != NULL; p = strtok_r(NULL, " ", &save)) {
+		if(*count == cap)
+			*paths = Grow(*paths, &cap, sizeof(char*));
+		(*paths)[(*count)++] = p;
+	}
+}
+
+void PrsRemote()
+{
+	Expect(TK_LEFT_PHAR);
+
+	PrsExpression();
+
+	Value cmd = PopVal();
+
+	if(!TypeIs(&cmd, VT_STRING))
+		ErrorHandle(lex, "Can't execute a non-string value");
+
+	size_t in_count = 0, out_count = 0;
+
+	char **inputs  = NULL;
+	char **outputs = NULL;
+	char  *in_list  = NULL;
+	char  *out_list = NULL;
+
+	if(AcceptB(TK_COMMA)) {
+		PrsExpression();
+
+		Value val = PopVal();
+
+		if(!TypeIs(&val, VT_STRING))
+			ErrorHandle(lex, "remote inputs must be a string");
+
+		in_list = strdup(ValueStr(&val));
+
+		PathList(in_list, &inputs, &in_count);
+
+		// Outputs come back from the worker once the command finishes
+		if(AcceptB(TK_COMMA)) {
+			PrsExpression();
+
+			val = PopVal();
+
+			if(!TypeIs(&val, VT_STRING))
+				ErrorHandle(lex, "remote outputs must be a string");
+
+			out_list = strdup(ValueStr(&val));
+
+			PathList(out_list, &outputs, &out_count);
+		}
+	}
+
+	Expect(TK_RIGHT_PHAR);
+
+	if(gb->checking) {
+	} else if(gb->dry_run) {
+		printf("%s\n", ValueStr(&cmd));
+		gb->dry_run_count++;
+	} else {
+		RemoteRun(ValueStr(&cmd), inputs, in_count, outputs, out_count);
+	}
+
+	free(inputs);
+	free(outputs);
+	free(in_list);
+	free(out_list);
+
+	PushInt(0);
+}
+
+void PrsCapture()
+{
+	Expect(TK_LEFT_PHAR);
+
+	PrsExpression();
+
+	Value cmd = PopVal();
+
+	if(!TypeIs(&cmd, VT_STRING))
+		ErrorHandle(lex, "Can't execute a non-string value");
+
+	int strip = 0;
+
+	if(AcceptB(TK_COMMA)) {
+		PrsExpression();
+
+		Value val = PopVal();
+
+		if(!TypeIs(&val, VT_INT))
+			ErrorHandle(lex, "capture expects an integer strip flag");
+
+		strip = val.cur_int != 0;
+	}
+
+	Expect(TK_RIGHT_PHAR);
+
+	if(gb->checking) {
+		PushString(CHECK_PLACEHOLDER);
+		return;
+	}
+
+	size_t len;
+	int status;
+
+	char *out = RunCapture(ValueStr(&cmd), &len, &status);
+
+	if(out == NULL)
+		ErrorHandle(lex, "Can't start command");
+
+	if(strip) {
+		while(len > 0 && (out[len - 1] == '\n' || out[len - 1] == '\r'))
+			out[--len] = 0;
+	}
+
+	Value val = ValueStringOwn(out, len);
+
+	if(len <= VALUE_INLINE_LEN)
+		free(out);
+
+	PushVal(&val);
+}
+
+void PrsMemo()
+{
+	Expect(TK_LEFT_PHAR);
+
+	LexState *start = lex;
+
+	StringBuilder *builder = StringBuilderNew();
+
+	int depth = 0;
+
+	int64_t tok;
+
+	// The key is the token text of the expression, plus the current value
+	// of every variable it mentions
+	for(;;) {
+		tok = LexPush(lexp);
+
+		if(depth == 0 && (tok == TK_COMMA || tok == TK_RIGHT_PHAR))
+			break;
+
+		if(tok == TK_EOF)
+			ErrorHandle(lex, "Can't find the end of memo()");
+
+		if(tok == TK_LEFT_PHAR  || tok == TK_LEFT_BRACK)  depth++;
+		if(tok == TK_RIGHT_PHAR || tok == TK_RIGHT_BRACK) depth--;
+
+		StringBuilderAppend(builder, "%s ", GetTokenName(tok));
+
+		switch(tok)
+		{
+		case TK_STRING: StringBuilderAppend(builder, "\"%s\" ", lexl->cur_str); break;
+		case TK_INT:    StringBuilderAppend(builder, "%ld ", lexl->cur_int);      break;
+		case TK_FLOAT:  StringBuilderAppend(builder, "%a ", lexl->cur_float);     break;
+		case TK_IDENT: {
+			StringBuilderAppend(builder, "%s ", lexl->cur_str);
+
+			Variable *var = VariableGet(lexl->cur_str);
+			if(var == NULL) break;
+
+			char num[VALUE_TEXT_LEN];
+			size_t len;
+
+			char *text = ValueKeyText(&var->value, num, &len);
+
+			StringBuilderAppend(builder, "=%u:%s ", var->value.type, text);
+			break;
+		  }
+		}
+	}
+
+	if(tok == TK_COMMA) {
+		do {
+			PrsExpression();
+
+			Value dep = PopVal();
+
+			if(!TypeIs(&dep, VT_STRING))
+				ErrorHandle(lex, "memo dependencies must be strings");
+
+			char *name = ValueStr(&dep);
+
+			if(strncmp(name, "env:", 4) == 0) {
+				char *env = getenv(&name[4]);
+				StringBuilderAppend(builder, "| %s=%s", name, env ? env : "(unset)");
+				continue;
+			}
+
+			struct stat s;
+
+			if(stat(name, &s) != 0) {
+				StringBuilderAppend(builder, "| %s missing", name);
+				continue;
+			}
+
+			StringBuilderAppend(builder, "| %s %lu %ld %ld.%ld", name, (unsigned long) s.st_ino,
+				(long) s.st_size, (long) s.st_mtim.tv_sec, (long) s.st_mtim.tv_nsec);
+		} while(AcceptB(TK_COMMA));
+
+		Expect(TK_RIGHT_PHAR);
+	}
+
+	char *text = StringBuild(builder);
+
+	StringBuilderDelete(builder);
+
+	uint64_t key = Hash64((uint8_t*) text, strlen(text));
+
+	Value *known = gb->checking ? NULL : MemoFind(key);
+
+	if(known != NULL) {
+		PushVal(known);
+		return;
+	}
+
+	LexState *after = lex;
+
+	lex = start;
+
+	PrsExpression();
+
+	Value val = PeekVal();
+
+	if(!gb->checking)
+		MemoStore(key, &val);
+
+	lex = after;
+}
+
 void PrsHex()
 {
 	Expect(TK_LEFT_PHAR);
@@ -71,12 +394,12 @@ void PrsHex()
 
 	Value num = PopVal();
 
-	if(num.type != VT_INT)
+	if(!TypeIs(&num, VT_INT))
 		ErrorHandle(lex, "Can't get the hex of a non-integer value");
 
 	Expect(TK_RIGHT_PHAR);
 
-	char *str = malloc(32);
+	char str[17];
 
 	size_t slen = 0;
 
@@ -91,9 +414,7 @@ void PrsHex()
 		str[slen++] = digit > 9 ? (digit - 10 + 'A') : (digit + '0');
 	}
 
-	str[slen] = 0;
-
-	PushString(str);
+	PushStringCopy(str, slen);
 }
 
 
@@ -105,15 +426,17 @@ void PrsHashof()
 
 	Value str = PopVal();
 
-	if(str.type != VT_STRING)
+	if(!TypeIs(&str, VT_STRING))
 		ErrorHandle(lex, "Can't get the hash of a non-string value");
 
 	Expect(TK_RIGHT_PHAR);
 
 	int64_t hash = 0;
 
+	char *cstr = ValueStr(&str);
+
 	for(size_t i = 0; i < str.str_len; i++) {
-		hash += str.cur_str[i];
+		hash += cstr[i];
 		hash  = hash << 5;
 		hash *= 12345;
 		hash ^= 0xE36CFA054FE2B427;
@@ -125,6 +448,29 @@ void PrsHashof()
 	PushInt(hash);
 }
 
+void PrsFilehash()
+{
+	Expect(TK_LEFT_PHAR);
+
+	PrsExpression();
+
+	Value path = PopVal();
+
+	if(!TypeIs(&path, VT_STRING))
+		ErrorHandle(lex, "File name must be a string");
+
+	Expect(TK_RIGHT_PHAR);
+
+	uint64_t hash;
+
+	if(!FileHash(ValueStr(&path), &hash)) {
+		PushInt(-1);
+		return;
+	}
+
+	PushInt(hash >> 1);
+}
+
 void PrsLengthof()
 {
 	Expect(TK_LEFT_PHAR);
@@ -133,7 +479,7 @@ void PrsLengthof()
 
 	Value str = PopVal();
 
-	if(str.type != VT_STRING)
+	if(!TypeIs(&str, VT_STRING))
 		ErrorHandle(lex, "Can't get the length of a non-string value");
 
 	Expect(TK_RIGHT_PHAR);
@@ -149,7 +495,7 @@ void PrsNewer()
 
 	Value str = PopVal();
 
-	if(str.type != VT_STRING)
+	if(!TypeIs(&str, VT_STRING))
 		ErrorHandle(lex, "File name must be a string");
 
 	Expect(TK_COMMA);
@@ -158,14 +504,16 @@ void PrsNewer()
 
 	Value str2 = PopVal();
 
-	if(str2.type != VT_STRING)
+	if(!TypeIs(&str2, VT_STRING))
 		ErrorHandle(lex, "File name must be a string");
 
 	Expect(TK_RIGHT_PHAR);
 
 	struct stat s;
 
-	int r = stat(str.cur_str, &s);
+	stats.stat_calls++;
+
+	int r = stat(ValueStr(&str), &s);
 
 	if(r != 0) {
 		PushInt(0);
@@ -174,7 +522,9 @@ void PrsNewer()
 
 	struct stat s2;
 
-	r = stat(str2.cur_str, &s2);
+	stats.stat_calls++;
+
+	r = stat(ValueStr(&str2), &s2);
 
 	if(r != 0) {
 		PushInt(1);
@@ -184,103 +534,716 @@ void PrsNewer()
 	PushInt(s.st_mtim.tv_sec > s2.st_mtim.tv_sec);
 }
 
-void PrsCut()
+// Adds the files named by a whitespace separated list of paths and patterns
+void StaleInputs(char *list, char ***paths, size_t *count, size_t *cap)
 {
-	Expect(TK_LEFT_PHAR);
+	char *save = NULL;
 
-	PrsExpression();
+	for(char *word = strtok_r(list, " \t\n", &save); word != NULL; word = strtok_r(NULL, " \t\n", &save)) {
+		glob_t g;
 
-	Value str = PopVal();
+		// Plain names come back as is, so a missing input still counts
+		if(glob(word, GLOB_NOSORT | GLOB_NOMAGIC, NULL, &g) != 0)
+			continue;
 
-	if(str.type != VT_STRING)
-		ErrorHandle(lex, "Can't cut a non-string value");
+		for(size_t i = 0; i < g.gl_pathc; i++) {
+			if(*count == *cap)
+				*paths = Grow(*paths, cap, sizeof(char*));
 
-	Expect(TK_COMMA);
+			(*paths)[(*count)++] = strdup(g.gl_pathv[i]);
+		}
 
-	PrsExpression();
+		globfree(&g);
+	}
+}
 
-	Value tmp   = PopVal();
-	int64_t low = tmp.cur_int;
+// stale(output, inputs...) is 1 when the output is missing or older than
+// any of the inputs
+void PrsStale()
+{
+	Expect(TK_LEFT_PHAR);
 
-	if(tmp.type != VT_INT)
-		ErrorHandle(lex, "Can't cut a string with non-integer lower bound");
-	if(low < 0)
-		ErrorHandle(lex, "Can't cut a string with negative lower bound");
+	size_t count = 0, cap = 0;
 
+	char **paths = NULL;
 
-	Expect(TK_COMMA);
+	do {
+		PrsExpression();
 
-	PrsExpression();
+		Value val = PopVal();
 
-	tmp = PopVal();
-	int64_t high = tmp.cur_int;
+		if(!TypeIs(&val, VT_STRING))
+			ErrorHandle(lex, "File name must be a string");
 
-	if(tmp.type != VT_INT)
-		ErrorHandle(lex, "Can't cut a string with non-integer upper bound");
-	if(high < 0)
-		ErrorHandle(lex, "Can't cut a string with negative upper bound");
+		char *str = strdup(ValueStr(&val));
+
+		if(count == 0) {
+			paths = Grow(paths, &cap, sizeof(char*));
+			paths[count++] = str;
+		} else {
+			StaleInputs(str, &paths, &count, &cap);
+			free(str);
+		}
+	} while(AcceptB(TK_COMMA));
 
 	Expect(TK_RIGHT_PHAR);
 
-	int64_t len = str.str_len - (low + high);
+	int64_t *mtimes = malloc(count * sizeof(int64_t));
+
+	StatMtimes(paths, count, mtimes);
 
-	if(len <= 0)
-		ErrorHandle(lex, "Can't cut an entire string");
+	stats.stat_calls += count;
 
-	char *nstr = calloc(len + 1, 1);
+	int stale = mtimes[0] < 0;
 
-	memcpy(nstr, &str.cur_str[low], str.str_len - high - low);
+	for(size_t i = 1; i < count && !stale; i++)
+		stale = mtimes[i] < 0 || mtimes[i] > mtimes[0];
 
-	PushString(nstr);
+	for(size_t i = 0; i < count; i++)
+		free(paths[i]);
+
+	free(paths);
+	free(mtimes);
+
+	PushInt(stale);
 }
 
-void PrsFactor()
+// Parses '(' string, string... ')' for the string builtins
+void PrsStringArgs(Value *args, size_t count, const char *name)
 {
-	if(Accept(TK_DOLLAR)) {
-		PrsShell();
-		return;
-	}
-	int64_t token = LexPush(lexp);
+	Expect(TK_LEFT_PHAR);
+
+	for(size_t i = 0; i < count; i++) {
+		if(i > 0)
+			Expect(TK_COMMA);
 
-	switch(token)
-	{
-	case TK_LEFT_PHAR:
-		PrsExpression();
-		Expect(TK_RIGHT_PHAR);
-		break;
-	case TK_STRING:
-		if(lexl->str_len == 0)
-			ErrorHandle(lex, "Can't have zero length strings");
-		PushString(lexl->cur_str);
-		break;
-	case TK_FLOAT:
-		PushFloat(lexl->cur_float);
-		break;
-	case TK_INT:
-		PushInt(lexl->cur_int);
-		break;
-	case TK_LOGICAL_NOT: {
 		PrsExpression();
 
-		Value val = PopVal();
+		args[i] = PopVal();
 
-		if(val.type == VT_STRING)
-			ErrorHandle(lex, "Can't get the logical not of a string");
+		if(!TypeIs(&args[i], VT_STRING)) {
+			printf("GBuildFile:%d: error: %s expects string arguments\n", lex->line, name);
+			ScriptExit(1);
+		}
+	}
 
-		if(val.type == VT_INT)
-			PushInt(val.cur_int == 0);
+	Expect(TK_RIGHT_PHAR);
+}
 
-		if(val.type == VT_FLOAT)
-			PushInt(val.cur_float == 0);
+// Pushes the tail of a string; long tails share the original's storage
+void PushSuffix(Value *str, size_t off)
+{
+	size_t len = str->str_len - off;
 
-		break;
-	  }
-	case TK_IDENT: {
-		if(strcmp(lexl->cur_str, "cut") == 0) {
-			PrsCut();
-			break;
-		} else if(strcmp(lexl->cur_str, "lengthof") == 0) {
-			PrsLengthof();
+	if(len <= VALUE_INLINE_LEN || str->str_len <= VALUE_INLINE_LEN) {
+		PushStringCopy(&ValueStr(str)[off], len);
+		return;
+	}
+
+	Value val = ValueString(&str->cur_str[off], len);
+	PushVal(&val);
+}
+
+size_t BaseOffset(Value *path)
+{
+	char *str   = ValueStr(path);
+	char *slash = memrchr(str, '/', path->str_len);
+
+	return slash ? (size_t) (slash - str) + 1 : 0;
+}
+
+// Offset of the dot starting the extension, or the length if there's none
+size_t ExtOffset(Value *path)
+{
+	char  *str  = ValueStr(path);
+	size_t base = BaseOffset(path);
+
+	char *dot = memrchr(&str[base], '.', path->str_len - base);
+
+	if(dot == NULL || dot == &str[base])
+		return path->str_len;
+
+	return dot - str;
+}
+
+void PrsStringBuiltin(const char *name)
+{
+	Value args[3];
+
+	if(strcmp(name, "replace") == 0) {
+		PrsStringArgs(args, 3, name);
+
+		char  *str  = ValueStr(&args[0]);
+		char  *from = ValueStr(&args[1]);
+		char  *to   = ValueStr(&args[2]);
+		size_t flen = args[1].str_len;
+		size_t tlen = args[2].str_len;
+
+		if(flen == 0) {
+			ValueError(lex, "Can't replace an empty string");
+			PushVal(&args[0]);
+			return;
+		}
+
+		size_t count = 0;
+
+		for(char *p = str; (p = memmem(p, &str[args[0].str_len] - p, from, flen)) != NULL; p += flen)
+			count++;
+
+		if(count == 0) {
+			PushVal(&args[0]);
+			return;
+		}
+
+		size_t len = args[0].str_len - count * flen + count * tlen;
+
+		char  tmp[VALUE_INLINE_LEN + 1];
+		char *out = len <= VALUE_INLINE_LEN ? tmp : malloc(len + 1);
+
+		char *o = out, *p = str, *end = &str[args[0].str_len];
+
+		for(char *hit; (hit = memmem(p, end - p, from, flen)) != NULL; p = hit + flen) {
+			memcpy(o, p, hit - p);
+			o += hit - p;
+			memcpy(o, to, tlen);
+			o += tlen;
+		}
+
+		memcpy(o, p, end - p);
+		out[len] = 0;
+
+		if(len <= VALUE_INLINE_LEN)
+			PushStringCopy(out, len);
+		else
+			PushStringOwn(out, len);
+	} else if(strcmp(name, "find") == 0) {
+		PrsStringArgs(args, 2, name);
+
+		char *str = ValueStr(&args[0]);
+		char *hit = memmem(str, args[0].str_len, ValueStr(&args[1]), args[1].str_len);
+
+		PushInt(hit ? hit - str : -1);
+	} else if(strcmp(name, "split") == 0) {
+		Expect(TK_LEFT_PHAR);
+
+		PrsExpression();
+		args[0] = PopVal();
+
+		Expect(TK_COMMA);
+
+		PrsExpression();
+		args[1] = PopVal();
+
+		Expect(TK_COMMA);
+
+		PrsExpression();
+		args[2] = PopVal();
+
+		Expect(TK_RIGHT_PHAR);
+
+		if(!TypeIs(&args[0], VT_STRING) || !TypeIs(&args[1], VT_STRING) || !TypeIs(&args[2], VT_INT))
+			ErrorHandle(lex, "split expects a string, a separator and a field index");
+
+		if(args[1].str_len == 0 || args[2].cur_int < 0) {
+			ValueError(lex, args[1].str_len == 0 ? "Can't split with an empty separator" : "Field index is smaller than 0");
+			PushStringCopy("", 0);
+			return;
+		}
+
+		char  *str = ValueStr(&args[0]);
+		char  *sep = ValueStr(&args[1]);
+		char  *end = &str[args[0].str_len];
+		size_t slen = args[1].str_len;
+
+		char *field = str;
+
+		for(int64_t i = 0; i < args[2].cur_int && field != NULL; i++) {
+			char *hit = memmem(field, end - field, sep, slen);
+			field = hit ? hit + slen : NULL;
+		}
+
+		if(field == NULL) {
+			PushStringCopy("", 0);
+			return;
+		}
+
+		char *hit = memmem(field, end - field, sep, slen);
+
+		PushStringCopy(field, (hit ? hit : end) - field);
+	} else if(strcmp(name, "startswith") == 0 || strcmp(name, "endswith") == 0) {
+		PrsStringArgs(args, 2, name);
+
+		size_t len = args[1].str_len;
+
+		if(len > args[0].str_len) {
+			PushInt(0);
+			return;
+		}
+
+		size_t off = name[0] == 's' ? 0 : args[0].str_len - len;
+
+		PushInt(memcmp(&ValueStr(&args[0])[off], ValueStr(&args[1]), len) == 0);
+	} else if(strcmp(name, "basename") == 0) {
+		PrsStringArgs(args, 1, name);
+
+		PushSuffix(&args[0], BaseOffset(&args[0]));
+	} else if(strcmp(name, "dirname") == 0) {
+		PrsStringArgs(args, 1, name);
+
+		size_t base = BaseOffset(&args[0]);
+
+		if(base == 0)
+			PushStringCopy(".", 1);
+		else if(base == 1)
+			PushStringCopy("/", 1);
+		else
+			PushStringCopy(ValueStr(&args[0]), base - 1);
+	} else if(strcmp(name, "ext") == 0) {
+		PrsStringArgs(args, 1, name);
+
+		size_t dot = ExtOffset(&args[0]);
+
+		PushSuffix(&args[0], dot < args[0].str_len ? dot + 1 : dot);
+	} else if(strcmp(name, "with_ext") == 0) {
+		PrsStringArgs(args, 2, name);
+
+		size_t stem = ExtOffset(&args[0]);
+		size_t elen = args[1].str_len;
+		size_t len  = stem + (elen > 0 ? elen + 1 : 0);
+
+		char  tmp[VALUE_INLINE_LEN + 1];
+		char *out = len <= VALUE_INLINE_LEN ? tmp : malloc(len + 1);
+
+		memcpy(out, ValueStr(&args[0]), stem);
+
+		if(elen > 0) {
+			out[stem] = '.';
+			memcpy(&out[stem + 1], ValueStr(&args[1]), elen);
+		}
+
+		out[len] = 0;
+
+		if(len <= VALUE_INLINE_LEN)
+			PushStringCopy(out, len);
+		else
+			PushStringOwn(out, len);
+	}
+}
+
+void PrsCut()
+{
+	Expect(TK_LEFT_PHAR);
+
+	PrsExpression();
+
+	Value str = PopVal();
+
+	if(!TypeIs(&str, VT_STRING))
+		ErrorHandle(lex, "Can't cut a non-string value");
+
+	Expect(TK_COMMA);
+
+	PrsExpression();
+
+	Value tmp   = PopVal();
+	int64_t low = tmp.cur_int;
+
+	if(!TypeIs(&tmp, VT_INT))
+		ErrorHandle(lex, "Can't cut a string with non-integer lower bound");
+	if(low < 0) {
+		ValueError(lex, "Can't cut a string with negative lower bound");
+		low = 0;
+	}
+
+
+	Expect(TK_COMMA);
+
+	PrsExpression();
+
+	tmp = PopVal();
+	int64_t high = tmp.cur_int;
+
+	if(!TypeIs(&tmp, VT_INT))
+		ErrorHandle(lex, "Can't cut a string with non-integer upper bound");
+	if(high < 0) {
+		ValueError(lex, "Can't cut a string with negative upper bound");
+		high = 0;
+	}
+
+	Expect(TK_RIGHT_PHAR);
+
+	int64_t len = str.str_len - (low + high);
+
+	if(len <= 0) {
+		ValueError(lex, "Can't cut an entire string");
+		PushVal(&str);
+		return;
+	}
+
+	PushStringCopy(&ValueStr(&str)[low], len);
+}
+
+// A dry run that gets to the end, or to #exit 0, says whether anything
+// would have run; a failing #exit stops it with the same status a real
+// run would have
+int ExitStatus(int status)
+{
+	return gb->dry_run && status == 0 ? gb->dry_run_count > 0 : status;
+}
+
+void ScriptExit(int status)
+{
+	if(gb->exit_jmp != NULL)
+		longjmp(*gb->exit_jmp, status + 1);
+
+	exit(ExitStatus(status));
+}
+
+// Runs a module in its own variable frame until it ends or exits
+int ExecuteModule(Module *mod, int argc, char **argv)
+{
+	LexState *saved     = lex;
+	Module   *saved_mod = gb->module;
+	jmp_buf  *outer     = gb->exit_jmp;
+	size_t    val_top   = gb->val_top;
+	size_t    val_base  = gb->val_base;
+	int       depth     = gb->call_depth;
+	jmp_buf   buf;
+
+	Frame *frame = FramePush();
+
+	DeclareArgs(argc, argv);
+	DeclareVariant();
+	ModuleEnter(mod);
+
+	gb->exit_jmp = &buf;
+
+	int status = setjmp(buf);
+
+	if(status == 0)
+		Parse();
+	else
+		status--;
+
+	gb->exit_jmp = outer;
+
+	FramePop(frame);
+
+	lex            = saved;
+	gb->module     = saved_mod;
+	gb->val_top    = val_top;
+	gb->val_base   = val_base;
+	gb->call_depth = depth;
+	gb->returning  = 0;
+
+	return status;
+}
+
+// Walks a module without side effects, so errors anywhere in it show up
+// before anything runs
+int CheckModule(Module *mod, int argc, char **argv)
+{
+	if(mod->checked) return 0;
+
+	// Set up front so a script including itself is walked once
+	mod->checked = 1;
+
+	int checking = gb->checking;
+	gb->checking = 1;
+
+	int status = ExecuteModule(mod, argc, argv);
+
+	gb->checking = checking;
+
+	if(status != 0)
+		mod->checked = 0;
+
+	return status;
+}
+
+void ExecuteInclude(Module *mod, int argc, char **argv)
+{
+	int status = gb->checking ? CheckModule(mod, argc, argv) : ExecuteModule(mod, argc, argv);
+
+	// A failing child script fails the script that included it
+	if(status != 0)
+		ScriptExit(status);
+}
+
+// Waits for one of pids to exit and clears its slot. Only these pids are
+// waited for, other threads may be waiting for children of their own. A
+// child sends its counters just before it exits, so the stats pipe ends
+// the sleep between scans early
+static int ReapChild(pid_t *pids, size_t count, int stats_fd)
+{
+	for(;;) {
+		for(size_t i = 0; i < count; i++) {
+			if(pids[i] <= 0) continue;
+
+			int   ws = 0;
+			pid_t r  = waitpid(pids[i], &ws, WNOHANG);
+
+			if(r == 0 || (r < 0 && errno == EINTR)) continue;
+
+			pids[i] = 0;
+
+			return r > 0 && WIFEXITED(ws) && WEXITSTATUS(ws) == 0;
+		}
+
+		struct pollfd p = { .fd = stats_fd, .events = POLLIN };
+
+		poll(&p, stats_fd >= 0, 50);
+
+		StatsCollect(stats_fd);
+	}
+}
+
+// Walks a directory's script from that directory, as its run will
+static int CheckSubdir(char *dir, Module *mod)
+{
+	int cwd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+	// A directory that can't be entered fails when it runs
+	if(cwd < 0 || chdir(dir) != 0) {
+		if(cwd >= 0) close(cwd);
+		return 0;
+	}
+
+	// Listings shared by variants are of the top directory only
+	HashMap *lists = gb->file_lists;
+	gb->file_lists = NULL;
+
+	int status = CheckModule(mod, gb->script_argc, gb->script_argv);
+
+	gb->file_lists = lists;
+
+	if(fchdir(cwd) != 0) {
+		printf("gbuild: fatal error: Can't return from %s\n", dir);
+		exit(1);
+	}
+
+	close(cwd);
+
+	return status;
+}
+
+void PrsSubdir()
+{
+	Expect(TK_LEFT_PHAR);
+
+	size_t count = 0, cap = 0;
+
+	char   **dirs = NULL;
+	Module **mods = NULL;
+
+	do {
+		PrsExpression();
+
+		Value val = PopVal();
+
+		if(!TypeIs(&val, VT_STRING))
+			ErrorHandle(lex, "Directory name must be a string");
+
+		if(count == cap) {
+			size_t mod_cap = cap;
+			dirs = Grow(dirs, &cap, sizeof(char*));
+			mods = Grow(mods, &mod_cap, sizeof(Module*));
+		}
+
+		dirs[count] = strdup(ValueStr(&val));
+
+		char *path = PathJoin(dirs[count], "GBuildFile");
+
+		mods[count] = ModuleLoad(path);
+
+		if(mods[count] == NULL && !gb->checking)
+			printf("gbuild: error: Can't read %s\n", path);
+
+		free(path);
+		count++;
+	} while(AcceptB(TK_COMMA));
+
+	Expect(TK_RIGHT_PHAR);
+
+	// The check pass walks every directory's script, so a mistake in one
+	// shows up before anything runs, but runs none of them
+	if(gb->checking) {
+		for(size_t i = 0; i < count; i++) {
+			int status = mods[i] ? CheckSubdir(dirs[i], mods[i]) : 0;
+
+			if(status != 0)
+				ScriptExit(status);
+
+			free(dirs[i]);
+		}
+
+		count = 0;
+	}
+
+	long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+	if(jobs < 1) jobs = 1;
+
+	int64_t failed  = 0;
+	long    running = 0;
+
+	int stats_fds[2] = { -1, -1 };
+
+	if(count > 0)
+		StatsPipe(stats_fds);
+
+	pid_t *pids = calloc(count + 1, sizeof(pid_t));
+
+	fflush(stdout);
+
+	for(size_t next = 0; next < count || running > 0;) {
+		while(running < jobs && next < count) {
+			Module *mod = mods[next];
+			char   *dir = dirs[next++];
+
+			if(mod == NULL) {
+				failed++;
+				continue;
+			}
+
+			pid_t pid = fork();
+
+			if(pid == 0) {
+				if(chdir(dir) != 0)
+					_exit(1);
+
+				jmp_buf buf;
+
+				RemoteForget();
+				MemoForget();
+
+				// Counters start over, the parent keeps what it counted
+				stats = (Stats) { 0 };
+
+				close(stats_fds[0]);
+
+				// Shared listings were made in the parent's directory
+				gb->file_lists = NULL;
+
+				FramePush();
+				DeclareArgs(gb->script_argc, gb->script_argv);
+				DeclareVariant();
+				ModuleEnter(mod);
+
+				// Each directory keeps a journal and a snapshot of its own
+				JournalDetach();
+				SnapshotBegin();
+
+				if(!gb->dry_run)
+					JournalBegin();
+
+				// #exit comes back here so the snapshot is still saved
+				gb->exit_jmp = &buf;
+
+				int status = setjmp(buf);
+
+				if(status == 0)
+					Parse();
+				else
+					status--;
+
+				gb->exit_jmp = NULL;
+
+				if(!gb->dry_run)
+					JournalEnd(status);
+
+				SnapshotEnd(status);
+				MemoEnd(status);
+				StatsSend(stats_fds[1]);
+				ScriptExit(status);
+			}
+
+			if(pid < 0) {
+				failed++;
+			} else {
+				pids[next - 1] = pid;
+				running++;
+			}
+		}
+
+		if(running == 0) break;
+
+		if(!ReapChild(pids, count, stats_fds[0]))
+			failed++;
+
+		running--;
+
+		StatsCollect(stats_fds[0]);
+	}
+
+	free(pids);
+
+	if(stats_fds[0] >= 0) {
+		close(stats_fds[0]);
+		close(stats_fds[1]);
+	}
+
+	for(size_t i = 0; i < count; i++)
+		free(dirs[i]);
+
+	free(dirs);
+	free(mods);
+
+	if(gb->dry_run)
+		gb->dry_run_count += failed;
+
+	PushInt(failed);
+}
+
+void PrsFactor()
+{
+	if(Accept(TK_DOLLAR)) {
+		PrsShell();
+		return;
+	}
+	int64_t token = LexPush(lexp);
+
+	switch(token)
+	{
+	case TK_LEFT_PHAR:
+		PrsExpression();
+		Expect(TK_RIGHT_PHAR);
+		break;
+	case TK_STRING:
+		if(lexl->str_len == 0)
+			ErrorHandle(lex, "Can't have zero length strings");
+		PushString(lexl->cur_str);
+		break;
+	case TK_FLOAT:
+		PushFloat(lexl->cur_float);
+		break;
+	case TK_INT:
+		PushInt(lexl->cur_int);
+		break;
+	case TK_LOGICAL_NOT: {
+		PrsComparison();
+
+		Value val = PopVal();
+
+		if(val.type == VT_STRING)
+			ErrorHandle(lex, "Can't get the logical not of a string");
+
+		if(val.type == VT_UNKNOWN)
+			PushInt(0);
+
+		if(val.type == VT_INT)
+			PushInt(val.cur_int == 0);
+
+		if(val.type == VT_FLOAT)
+			PushInt(val.cur_float == 0);
+
+		break;
+	  }
+	case TK_IDENT: {
+		if(strcmp(lexl->cur_str, "cut") == 0) {
+			PrsCut();
+			break;
+		} else if(strcmp(lexl->cur_str, "lengthof") == 0) {
+			PrsLengthof();
 			break;
 		} else if(strcmp(lexl->cur_str, "uptime") == 0) {
 			Expect(TK_LEFT_PHAR);
@@ -295,20 +1258,64 @@ void PrsFactor()
 		} else if(strcmp(lexl->cur_str, "newer") == 0) {
 			PrsNewer();
 			break;
+		} else if(strcmp(lexl->cur_str, "stale") == 0) {
+			PrsStale();
+			break;
 		} else if(strcmp(lexl->cur_str, "hashof") == 0) {
 			PrsHashof();
 			break;
 		} else if(strcmp(lexl->cur_str, "hexof") == 0) {
 			PrsHex();
 			break;
-		} 
+		} else if(strcmp(lexl->cur_str, "filehash") == 0) {
+			PrsFilehash();
+			break;
+		} else if(strcmp(lexl->cur_str, "capture") == 0) {
+			PrsCapture();
+			break;
+		} else if(strcmp(lexl->cur_str, "memo") == 0) {
+			PrsMemo();
+			break;
+		} else if(strcmp(lexl->cur_str, "subdir") == 0) {
+			PrsSubdir();
+			break;
+		} else if(strcmp(lexl->cur_str, "remote") == 0) {
+			PrsRemote();
+			break;
+		} else if(strcmp(lexl->cur_str, "replace") == 0    || strcmp(lexl->cur_str, "find") == 0     ||
+		          strcmp(lexl->cur_str, "split") == 0      || strcmp(lexl->cur_str, "startswith") == 0 ||
+		          strcmp(lexl->cur_str, "endswith") == 0   || strcmp(lexl->cur_str, "basename") == 0 ||
+		          strcmp(lexl->cur_str, "dirname") == 0    || strcmp(lexl->cur_str, "ext") == 0      ||
+		          strcmp(lexl->cur_str, "with_ext") == 0) {
+			PrsStringBuiltin(lexl->cur_str);
+			break;
+		} else if(strcmp(lexl->cur_str, "remote_wait") == 0) {
+			Expect(TK_LEFT_PHAR);
+			Expect(TK_RIGHT_PHAR);
+
+			PushInt(gb->checking ? 0 : RemoteWait());
+			break;
+		}
+
 
 
+		Function *fn = FunctionGet(lexl->cur_str);
+
+		if(fn != NULL && PeekCall()) {
+			PrsCall(fn);
+			break;
+		}
 
 		Variable *var = VariableGet(lexl->cur_str);
+
+		// Script arguments aren't known until the script runs
+		if(var == NULL && gb->checking && strncmp(lexl->cur_str, "arg", 3) == 0 &&
+		   lexl->cur_str[3] != 0 && strspn(&lexl->cur_str[3], "0123456789") == strlen(&lexl->cur_str[3]))
+			var = CheckPlaceholder(lexl->cur_str);
+
 		if(var == NULL) {
 			printf("GBuildFile:%d: error: Can't find variable '%s'\n", lex->line, lexl->cur_str);
-			exit(1);
+			ScriptExit(1);
 		}
 
 		LexState *saved = lex;
@@ -323,7 +1330,7 @@ void PrsFactor()
 			PrsExpression();
 			var->value = PopVal();
 		} else if(AcceptB(TK_LEFT_BRACK)) {
-			if(var->value.type != VT_STRING)
+			if(!TypeIs(&var->value, VT_STRING))
 				ErrorHandle(lex, "Can't dereference non-string value");
 
 			PrsExpression();
@@ -332,22 +1339,18 @@ void PrsFactor()
 
 			Value val = PopVal();
 
-			if(val.type != VT_INT)
+			if(!TypeIs(&val, VT_INT))
 				ErrorHandle(lex, "String index is not an integer");
 
 			int64_t index = val.cur_int;
 
-			if(index < 0)
-				ErrorHandle(lex, "String index is smaller than 0");
-
-			if((size_t) index >= var->value.str_len)
-				ErrorHandle(lex, "String index is out of bounds");
-				
-
-			char *str = calloc(1, 2);
-			str[0] = var->value.cur_str[index];
+			if(index < 0 || (size_t) index >= var->value.str_len) {
+				ValueError(lex, index < 0 ? "String index is smaller than 0" : "String index is out of bounds");
+				PushStringCopy(CHECK_PLACEHOLDER, 1);
+				break;
+			}
 
-			PushString(str);
+			PushStringCopy(&ValueStr(&var->value)[index], 1);
 			break;
 		}
 
@@ -356,7 +1359,7 @@ void PrsFactor()
 	  }
 	default:
 		printf("GBuildFile:%d: error: Expected factor, got '%s'\n", lex->line, GetTokenName(token));
-		exit(1);
+		ScriptExit(1);
 	}
 }
 
@@ -371,27 +1374,38 @@ void PrsTerm()
 		Value v2 = PopVal();
 		Value v1 = PopVal();
 
+		if(v1.type == VT_UNKNOWN || v2.type == VT_UNKNOWN) {
+			PushVal(&(Value) { .type = VT_UNKNOWN });
+			continue;
+		}
+
 		if(tok == TK_STAR) {
 			if(v1.type == VT_STRING || v2.type == VT_STRING) {
 				Value str   = v1.type == VT_STRING ? v1 : v2;
 				Value other = v1.type == VT_STRING ? v2 : v1;
 
-				if(other.type != VT_INT)
+				if(!TypeIs(&other, VT_INT))
 					ErrorHandle(lex, "Can't multiply a string with a non-integer value");
 
-				if(other.cur_int < 0)
-					ErrorHandle(lex, "Can't multiply a string with a negative value");
+				if(other.cur_int < 0) {
+					ValueError(lex, "Can't multiply a string with a negative value");
+					other.cur_int = 0;
+				}
 
-				StringBuilder *builder = StringBuilderNew();
+				size_t len = str.str_len * other.cur_int;
 
-				for(int64_t i = 0; i < other.cur_int; i++)
-					StringBuilderAppend(builder, "%s", str.cur_str);
+				char  tmp[VALUE_INLINE_LEN + 1];
+				char *built_str = len <= VALUE_INLINE_LEN ? tmp : malloc(len + 1);
 
-				char *built_str = StringBuild(builder);
+				for(int64_t i = 0; i < other.cur_int; i++)
+					memcpy(&built_str[i * str.str_len], ValueStr(&str), str.str_len);
 
-				StringBuilderDelete(builder);
+				built_str[len] = 0;
 
-				PushString(built_str);
+				if(len <= VALUE_INLINE_LEN)
+					PushStringCopy(built_str, len);
+				else
+					PushStringOwn(built_str, len);
 			} else if(v1.type == VT_FLOAT || v2.type == VT_FLOAT) {
 				PushFloat(ValueNum(&v1) * ValueNum(&v2));
 			} else if(v1.type == VT_INT && v2.type == VT_INT) {
@@ -402,129 +1416,487 @@ void PrsTerm()
 				ErrorHandle(lex, "Can't divide strings");
 
 			if((v2.type == VT_INT ? v2.cur_int : v2.cur_float) == 0)
-				ErrorHandle(lex, "Can't divide number by 0");
+				ValueError(lex, "Can't divide number by 0");
+
+			PushFloat((double) (v1.type == VT_FLOAT ? v1.cur_float : v1.cur_int) /
+				(double) (v2.type == VT_FLOAT ? v2.cur_float : v2.cur_int));
+		}
+	}
+}
+
+void PrsExpression0()
+{
+	PrsTerm();
+
+	while(Accept(TK_PLUS) || Accept(TK_MINUS)) {
+		int64_t tok = LexPush(lexp);
+		PrsTerm();
+
+		Value v2 = PopVal();
+		Value v1 = PopVal();
+
+		if(v1.type == VT_UNKNOWN || v2.type == VT_UNKNOWN) {
+			PushVal(&(Value) { .type = VT_UNKNOWN });
+			continue;
+		}
+
+		if(tok == TK_PLUS) {
+			if(v1.type == VT_STRING || v2.type == VT_STRING) {
+
+				char num1[VALUE_TEXT_LEN], num2[VALUE_TEXT_LEN];
+
+				size_t len1, len2;
+
+				char *str1 = ValueText(&v1, num1, &len1);
+				char *str2 = ValueText(&v2, num2, &len2);
+
+				size_t len = len1 + len2;
+
+				char  tmp[VALUE_INLINE_LEN + 1];
+				char *built_str = len <= VALUE_INLINE_LEN ? tmp : malloc(len + 1);
+
+				memcpy(built_str, str1, len1);
+				memcpy(&built_str[len1], str2, len2);
+				built_str[len] = 0;
+
+				if(len <= VALUE_INLINE_LEN)
+					PushStringCopy(built_str, len);
+				else
+					PushStringOwn(built_str, len);
+			} else if(v1.type == VT_FLOAT || v2.type == VT_FLOAT) {
+
+				PushFloat(ValueNum(&v1) + ValueNum(&v2));
+
+			} else if(v1.type == VT_INT && v2.type == VT_INT) {
+				PushInt(v1.cur_int + v2.cur_int); 
+			}
+		} else {
+			if(v1.type == VT_STRING || v2.type == VT_STRING) {
+				ErrorHandle(lex, "Can't subtract from strings");
+			} else if(v1.type == VT_FLOAT || v2.type == VT_FLOAT) {
+				PushFloat(ValueNum(&v1) - ValueNum(&v2));
+			} else if(v1.type == VT_INT && v2.type == VT_INT) {
+				PushInt(v1.cur_int - v2.cur_int); 
+			}
+		}
+	}
+}
+
+void PrsComparison()
+{
+	PrsExpression0();
+
+	while(Accept(TK_GREATER) || Accept(TK_LESSER) || Accept(TK_EQUALS) || Accept(TK_LOGICAL_NOT)) {
+		int64_t tok = LexPush(lexp);
+		int aequ = 0;
+
+		if(tok == TK_EQUALS || tok == TK_LOGICAL_NOT)
+			Expect(TK_EQUALS);
+
+		if(tok != TK_EQUALS && tok != TK_LOGICAL_NOT) {
+			if(AcceptB(TK_EQUALS)) {
+				aequ = 1;
+			}
+		}
+
+		PrsExpression0();
+
+		Value v2 = PopVal();
+		Value v1 = PopVal();
+
+		if(v1.type == VT_UNKNOWN || v2.type == VT_UNKNOWN) {
+			PushInt(0);
+			continue;
+		}
+
+		if(tok == TK_GREATER || tok == TK_LESSER) {
+			if(v2.type == VT_STRING || v1.type == VT_STRING)
+				ErrorHandle(lex, "Can't compare strings with greater / lesser signs");
+
+			if(tok == TK_GREATER) {
+				if(aequ)
+					PushInt(ValueNum(&v1) >= ValueNum(&v2));
+				else
+					PushInt(ValueNum(&v1) > ValueNum(&v2));
+			} else {
+				if(aequ)
+					PushInt(ValueNum(&v1) <= ValueNum(&v2));
+				else
+					PushInt(ValueNum(&v1) < ValueNum(&v2));
+			}
+		} else if(tok == TK_EQUALS) {
+			if((v1.type == VT_STRING || v2.type == VT_STRING)) {
+				if(!TypeIs(&v1, VT_STRING) || !TypeIs(&v2, VT_STRING))
+					ErrorHandle(lex, "Can't compare string with a non-string value");
+
+				size_t len = v1.str_len > v2.str_len ? v1.str_len : v2.str_len;
+
+				PushInt(strncmp(ValueStr(&v1), ValueStr(&v2), len) == 0);
+			} else {
+				PushInt(ValueNum(&v1) == ValueNum(&v2));
+			}
+		} else if(tok == TK_LOGICAL_NOT) {
+			if((v1.type == VT_STRING || v2.type == VT_STRING)) {
+				if(!TypeIs(&v1, VT_STRING) || !TypeIs(&v2, VT_STRING))
+					ErrorHandle(lex, "Can't compare string with a non-string value");
+
+				size_t len = v1.str_len > v2.str_len ? v1.str_len : v2.str_len;
+
+				PushInt(strncmp(ValueStr(&v1), ValueStr(&v2), len) != 0);
+			} else {
+				PushInt(ValueNum(&v1) != ValueNum(&v2));
+			}
+		}
+	}
+}
+
+int ValueTruth(Value *val)
+{
+	if(val->type == VT_UNKNOWN)
+		return 0;
+
+	if(val->type == VT_STRING)
+		ErrorHandle(lex, "A string can't be true / false");
+
+	return val->type == VT_FLOAT ? (val->cur_float != 0) : (val->cur_int != 0);
+}
+
+// Checks for a two character operator such as '&&' without consuming it
+int PeekPair(int64_t token)
+{
+	LexState *saved = lex;
+
+	int r = LexPush(lexp) == token && LexPush(lexp) == token;
+
+	lex = saved;
+	LexStateDelete(lex->next);
+
+	return r;
+}
+
+// Steps over the right operand of '&&' / '||' without evaluating it, so
+// no command inside it runs
+void SkipOperand(int stop_at_and)
+{
+	int depth = 0;
+
+	for(;;) {
+		LexState *saved = lex;
+
+		int64_t tok = LexPush(lexp);
+
+		if(depth == 0) {
+			int end = tok == TK_RIGHT_PHAR || tok == TK_RIGHT_BRACK || tok == TK_COMMA ||
+				tok == TK_SEMICOLON || tok == TK_LEFT_CURLY || tok == TK_RIGHT_CURLY || tok == TK_EOF;
+
+			if(!end && (tok == TK_OR || (tok == TK_AND && stop_at_and))) {
+				lex = saved;
+				end = PeekPair(tok);
+				LexPush(lexp);
+			}
+
+			if(end) {
+				lex = saved;
+				LexStateDelete(lex->next);
+				return;
+			}
+		}
+
+		if(tok == TK_LEFT_PHAR  || tok == TK_LEFT_BRACK)  depth++;
+		if(tok == TK_RIGHT_PHAR || tok == TK_RIGHT_BRACK) depth--;
+	}
+}
+
+void PrsAnd()
+{
+	PrsComparison();
+
+	while(PeekPair(TK_AND)) {
+		Expect(TK_AND);
+		Expect(TK_AND);
+
+		Value v1 = PopVal();
+
+		// The check pass looks at both operands
+		if(!ValueTruth(&v1) && !gb->checking) {
+			SkipOperand(1);
+			PushInt(0);
+			continue;
+		}
+
+		PrsComparison();
+
+		Value v2 = PopVal();
+		PushInt(ValueTruth(&v2));
+	}
+}
+
+void PrsExpression()
+{
+	PrsAnd();
+
+	while(PeekPair(TK_OR)) {
+		Expect(TK_OR);
+		Expect(TK_OR);
+
+		Value v1 = PopVal();
+
+		if(ValueTruth(&v1) && !gb->checking) {
+			SkipOperand(0);
+			PushInt(1);
+			continue;
+		}
+
+		PrsAnd();
+
+		Value v2 = PopVal();
+		PushInt(ValueTruth(&v2));
+	}
+}
+
+Function *FunctionGet(const char *name)
+{
+	if(gb->vars.functions == NULL) return NULL;
+
+	return HashFind(gb->vars.functions, (uint8_t*) name, strlen(name));
+}
+
+// Checks for '(' after a name without consuming it
+int PeekCall()
+{
+	LexState *saved = lex;
+
+	int r = LexPush(lexp) == TK_LEFT_PHAR;
+
+	lex = saved;
+	LexStateDelete(lex->next);
+
+	return r;
+}
+
+// Runs a function body with its parameters bound, from wherever the call is
+Value FunctionRun(Function *fn, Value *args)
+{
+	// The check pass walks every body, but a recursive call only once
+	if(gb->checking && fn->active)
+		return (Value) { .type = VT_UNKNOWN };
+
+	LexState *saved    = lex;
+	size_t    val_base = gb->val_base;
+	Value     ret      = gb->ret;
+	int       has_ret  = gb->has_ret;
+
+	gb->val_base = gb->val_top;
+	gb->ret      = (Value) { .type = VT_INT };
+	gb->has_ret  = 0;
+
+	Variable **hidden = malloc(fn->param_count * sizeof(Variable*));
+
+	ScopePush();
+
+	// Parameters shadow variables of the same name until the call returns
+	for(size_t i = 0; i < fn->param_count; i++) {
+		hidden[i] = VariableGet(fn->params[i]);
+
+		Variable *var = calloc(1, sizeof(Variable));
+
+		var->name  = fn->params[i];
+		var->value = args[i];
+
+		VariableNew(var);
+	}
+
+	fn->active++;
+	gb->call_depth++;
+
+	lex = LexStateNew();
+	memcpy(lex, fn->body, sizeof(LexState));
+	PrsBody();
+
+	fn->active--;
+	gb->call_depth--;
+	gb->returning = 0;
+
+	ScopePop();
+
+	for(size_t i = 0; i < fn->param_count; i++)
+		if(hidden[i] != NULL)
+			VariableRestore(hidden[i]);
+
+	free(hidden);
+
+	Value val = gb->ret;
+
+	gb->val_top  = gb->val_base;
+	gb->val_base = val_base;
+	gb->ret      = ret;
+	gb->has_ret  = has_ret;
+
+	lex = saved;
+
+	return val;
+}
+
+// The argument tuple of a pure call, as the key of its memoized result
+char *FunctionKey(Value *args, size_t count)
+{
+	StringBuilder *builder = StringBuilderNew();
+
+	for(size_t i = 0; i < count; i++) {
+		char num[VALUE_TEXT_LEN];
+		size_t len;
+
+		char *text = ValueKeyText(&args[i], num, &len);
+
+		StringBuilderAppend(builder, "%u:%zu:%s|", args[i].type, len, text);
+	}
+
+	char *key = StringBuild(builder);
+
+	StringBuilderDelete(builder);
+
+	return key;
+}
+
+void PrsCall(Function *fn)
+{
+	Expect(TK_LEFT_PHAR);
+
+	size_t count = 0, cap = 0;
+
+	Value *args = NULL;
+
+	if(!AcceptB(TK_RIGHT_PHAR)) {
+		do {
+			PrsExpression();
+
+			if(count == cap)
+				args = Grow(args, &cap, sizeof(Value));
+
+			args[count++] = PopVal();
+		} while(AcceptB(TK_COMMA));
+
+		Expect(TK_RIGHT_PHAR);
+	}
+
+	if(count != fn->param_count) {
+		printf("GBuildFile:%d: error: Function '%s' expects %zu arguments, got %zu\n", lex->line, fn->name, fn->param_count, count);
+		ScriptExit(1);
+	}
+
+	char *key = NULL;
+
+	if(fn->pure && !gb->checking) {
+		key = FunctionKey(args, count);
+
+		Value *known = HashFind(fn->results, (uint8_t*) key, strlen(key));
+
+		if(known != NULL) {
+			PushVal(known);
+
+			free(key);
+			free(args);
+			return;
+		}
+	}
+
+	Value val = FunctionRun(fn, args);
+
+	if(key != NULL) {
+		Value *copy = malloc(sizeof(Value));
+		*copy = val;
 
-			PushFloat((double) (v1.type == VT_FLOAT ? v1.cur_float : v1.cur_int) /
-				(double) (v2.type == VT_FLOAT ? v2.cur_float : v2.cur_int));
-		}
+		HashPut(fn->results, (uint8_t*) key, strlen(key), copy);
 	}
+
+	free(args);
+
+	PushVal(&val);
 }
 
-void PrsExpression0()
+void PrsFunction()
 {
-	PrsTerm();
+	int pure = AcceptIdentB("pure");
 
-	while(Accept(TK_PLUS) || Accept(TK_MINUS)) {
-		int64_t tok = LexPush(lexp);
-		PrsTerm();
+	ExpectIdent("fn");
 
-		Value v2 = PopVal();
-		Value v1 = PopVal();
+	Expect(TK_IDENT);
 
-		if(tok == TK_PLUS) {
-			if(v1.type == VT_STRING || v2.type == VT_STRING) {
+	if(IsReserved(lexl->cur_str)) {
+		printf("GBuildFile:%d: error: Function name reserved\n", lex->line);
+		ScriptExit(1);
+	}
 
-				StringBuilder *builder = StringBuilderNew();
+	if(FunctionGet(lexl->cur_str) != NULL) {
+		printf("GBuildFile:%d: error: Function '%s' already exists\n", lex->line, lexl->cur_str);
+		ScriptExit(1);
+	}
 
-				switch(v1.type)
-				{
-				case VT_INT: StringBuilderAppend(builder,    "%ld", v1.cur_int);  break;
-				case VT_FLOAT: StringBuilderAppend(builder,  "%f", v1.cur_float); break;
-				case VT_STRING: StringBuilderAppend(builder, "%s", v1.cur_str);   break;
-				}
+	Function *fn = calloc(1, sizeof(Function));
 
-				switch(v2.type)
-				{
-				case VT_INT: StringBuilderAppend(builder,    "%ld", v2.cur_int);  break;
-				case VT_FLOAT: StringBuilderAppend(builder,  "%f", v2.cur_float); break;
-				case VT_STRING: StringBuilderAppend(builder, "%s", v2.cur_str);   break;
-				}
+	fn->name = strdup(lexl->cur_str);
+	fn->pure = pure;
 
-				char *built_str = StringBuild(builder);
+	if(pure)
+		fn->results = HashMapNew(256, HashDefaultFunction);
 
-				StringBuilderDelete(builder);
+	Expect(TK_LEFT_PHAR);
 
-				PushString(built_str);
-			} else if(v1.type == VT_FLOAT || v2.type == VT_FLOAT) {
+	size_t cap = 0;
 
-				PushFloat(ValueNum(&v1) + ValueNum(&v2));
+	if(!AcceptB(TK_RIGHT_PHAR)) {
+		do {
+			Expect(TK_IDENT);
 
-			} else if(v1.type == VT_INT && v2.type == VT_INT) {
-				PushInt(v1.cur_int + v2.cur_int); 
-			}
-		} else {
-			if(v1.type == VT_STRING || v2.type == VT_STRING) {
-				ErrorHandle(lex, "Can't subtract from strings");
-			} else if(v1.type == VT_FLOAT || v2.type == VT_FLOAT) {
-				PushFloat(ValueNum(&v1) - ValueNum(&v2));
-			} else if(v1.type == VT_INT && v2.type == VT_INT) {
-				PushInt(v1.cur_int - v2.cur_int); 
-			}
-		}
-	}
-}
+			if(fn->param_count == cap)
+				fn->params = Grow(fn->params, &cap, sizeof(char*));
 
-void PrsExpression()
-{
-	PrsExpression0();
+			fn->params[fn->param_count++] = strdup(lexl->cur_str);
+		} while(AcceptB(TK_COMMA));
 
-	while(Accept(TK_GREATER) || Accept(TK_LESSER) || Accept(TK_EQUALS) || Accept(TK_LOGICAL_NOT)) {
-		int64_t tok = LexPush(lexp);
-		int aequ = 0;
+		Expect(TK_RIGHT_PHAR);
+	}
 
-		if(tok == TK_EQUALS || tok == TK_LOGICAL_NOT)
-			Expect(TK_EQUALS);
+	fn->body = LexStateNew();
+	memcpy(fn->body, lex, sizeof(LexState));
 
-		if(tok != TK_EQUALS && tok != TK_LOGICAL_NOT) {
-			if(AcceptB(TK_EQUALS)) {
-				aequ = 1;
-			}
-		}
+	FunctionNew(fn->name, fn);
 
-		PrsExpression0();
+	// Parameters have no type until a call, so the check pass walks the
+	// body at each call instead of here
+	SkipBody();
+}
 
-		Value v2 = PopVal();
-		Value v1 = PopVal();
+void PrsReturn()
+{
+	ExpectIdent("return");
 
-		if(tok == TK_GREATER || tok == TK_LESSER) {
-			if(v2.type == VT_STRING || v1.type == VT_STRING)
-				ErrorHandle(lex, "Can't compare strings with greater / lesser signs");
+	if(gb->call_depth == 0)
+		ErrorHandle(lex, "Can't return outside of a function");
 
-			if(tok == TK_GREATER) {
-				if(aequ)
-					PushInt(ValueNum(&v1) >= ValueNum(&v2));
-				else
-					PushInt(ValueNum(&v1) > ValueNum(&v2));
-			} else {
-				if(aequ)
-					PushInt(ValueNum(&v1) <= ValueNum(&v2));
-				else
-					PushInt(ValueNum(&v1) < ValueNum(&v2));
-			}
-		} else if(tok == TK_EQUALS) {
-			if((v1.type == VT_STRING || v2.type == VT_STRING)) {
-				if(v1.type != VT_STRING || v2.type != VT_STRING)
-					ErrorHandle(lex, "Can't compare string with a non-string value");
+	Value val = { .type = VT_INT };
 
-				size_t len = v1.str_len > v2.str_len ? v1.str_len : v2.str_len;
+	if(!Accept(TK_SEMICOLON)) {
+		PrsExpression();
+		val = PopVal();
+	}
 
-				PushInt(strncmp(v1.cur_str, v2.cur_str, len) == 0);
-			} else {
-				PushInt(ValueNum(&v1) == ValueNum(&v2));
-			}
-		} else if(tok == TK_LOGICAL_NOT) {
-			if((v1.type == VT_STRING || v2.type == VT_STRING)) {
-				if(v1.type != VT_STRING || v2.type != VT_STRING)
-					ErrorHandle(lex, "Can't compare string with a non-string value");
+	Expect(TK_SEMICOLON);
 
-				size_t len = v1.str_len > v2.str_len ? v1.str_len : v2.str_len;
+	// The check pass keeps walking the body after a return; returns of
+	// different types make the call's type unknown
+	if(gb->checking) {
+		if(!gb->has_ret)
+			gb->ret = val;
+		else if(gb->ret.type != val.type)
+			gb->ret = (Value) { .type = VT_UNKNOWN };
 
-				PushInt(strncmp(v1.cur_str, v2.cur_str, len) != 0);
-			} else {
-				PushInt(ValueNum(&v1) != ValueNum(&v2));
-			}
-		}
+		gb->has_ret = 1;
+		return;
 	}
+
+	gb->ret       = val;
+	gb->returning = 1;
 }
 
 void PrsVarDecl()
@@ -536,17 +1908,48 @@ void PrsVarDecl()
 
 	if(IsReserved(lexl->cur_str)) {
 		printf("GBuildFile:%d: error: Variable name reserved\n", lex->line);
-		exit(1);
+		ScriptExit(1);
 	}
 
-	if(VariableGet(lexl->cur_str) != NULL) {
-		printf("GBuildFile:%d: error: Variable '%s' already exists\n", lex->line, lexl->cur_str);
-		exit(1);
+	char *name = lexl->cur_str;
+
+	// The active variant's values replace a script's top level defaults;
+	// the default still decides whether the value is a number
+	if(gb->call_depth == 0 && gb->vars.scope_top == 1 && VariantValue(name) != NULL) {
+		Variable *var = VariableGet(name);
+
+		if(AcceptB(TK_EQUALS)) {
+			PrsExpression();
+
+			Value def = PopVal();
+
+			const char *text = VariantValue(name);
+			char       *end;
+
+			if(def.type == VT_INT) {
+				int64_t num = strtoll(text, &end, 0);
+
+				if(*text != 0 && *end == 0)
+					var->value = (Value) { .type = VT_INT, .cur_int = num };
+			} else if(def.type == VT_FLOAT) {
+				double num = strtod(text, &end);
+
+				if(*text != 0 && *end == 0)
+					var->value = (Value) { .type = VT_FLOAT, .cur_float = num };
+			}
+		}
+
+		return;
+	}
+
+	if(VariableGet(name) != NULL) {
+		printf("GBuildFile:%d: error: Variable '%s' already exists\n", lex->line, name);
+		ScriptExit(1);
 	}
 
 	Variable *var = calloc(1, sizeof(Variable));
 
-	var->name = lexl->cur_str;
+	var->name = name;
 
 	if(AcceptB(TK_EQUALS)) {
 		PrsExpression();
@@ -567,6 +1970,13 @@ void PrsBody()
 		PrsStatement();
 		ClearVal();
 
+		// The rest of the body is left unread, the call goes back to
+		// where it was made
+		if(gb->returning) {
+			ScopePop();
+			return;
+		}
+
 		if(Accept(TK_EOF))
 			ErrorHandle(lex, "Can't find matching '}'");
 	}
@@ -578,6 +1988,10 @@ void PrsBody()
 void SkipBody()
 {
 	Expect(TK_LEFT_CURLY);
+
+	if(BraceSkip())
+		return;
+
 	int depth = 1;
 
 	while(depth) {
@@ -596,116 +2010,412 @@ void PrsIf()
 {
 	ExpectIdent("if");
 
-	Expect(TK_LEFT_PHAR);
+	Expect(TK_LEFT_PHAR);
+
+	PrsExpression();
+
+	Value val = PopVal();
+
+	int is_true = ValueTruth(&val);
+
+	Expect(TK_RIGHT_PHAR);
+
+	// The check pass walks both branches from the same state, and whatever
+	// they leave with different types is unknown after the if
+	if(gb->checking) {
+		size_t count;
+
+		Value *before = VariablesSave(&count);
+
+		PrsBody();
+
+		Value *after = VariablesSave(&count);
+
+		VariablesRestore(before);
+
+		if(AcceptIdentB("else"))
+			PrsBody();
+
+		VariablesJoin(after);
+
+		free(before);
+		free(after);
+	} else if(is_true) {
+		PrsBody();
+		if(gb->returning)
+			return;
+		if(AcceptIdentB("else"))
+			SkipBody();
+	} else {
+		SkipBody();
+
+		if(AcceptIdentB("else")) {
+			PrsBody();
+		}
+	}
+}
+
+// The extension is everything after the first dot, so "a.tar.gz" is "tar.gz"
+int ExtMatches(const char *name, const char *target_ext)
+{
+	const char *dot = strchr(name, '.');
+
+	return strcmp(dot ? dot + 1 : "", target_ext) == 0;
+}
+
+// Walks cur_dir for the files of target_ext; with list set, the
+// directories walked are recorded in it as well
+static void CollectWalk(char *target_ext, char *cur_dir, char ***paths, size_t *count, size_t *cap, FileList *list, size_t *dir_cap)
+{
+	DIR *dir = opendir(cur_dir);
+	if(dir == NULL) return;
+
+	stats.dirs_scanned++;
+
+	if(list != NULL) {
+		if(list->dir_count == *dir_cap)
+			list->dirs = Grow(list->dirs, dir_cap, sizeof(char*));
+
+		list->dirs[list->dir_count++] = strdup(cur_dir);
+	}
+
+	struct dirent *ent;
+
+	while((ent = readdir(dir)) != NULL) {
+		stats.entries_scanned++;
+
+		if(ent->d_type == DT_REG && ExtMatches(ent->d_name, target_ext)) {
+			if(*count == *cap)
+				*paths = Grow(*paths, cap, sizeof(char*));
+
+			(*paths)[(*count)++] = PathJoin(cur_dir, ent->d_name);
+		} else if(ent->d_type == DT_DIR && ent->d_name[0] != '.') {
+			char *dir_name = PathJoin(cur_dir, ent->d_name);
+
+			CollectWalk(target_ext, dir_name, paths, count, cap, list, dir_cap);
+
+			free(dir_name);
+		}
+	}
+
+	closedir(dir);
+}
+
+void CollectFiles(char *target_ext, char *cur_dir, char ***paths, size_t *count, size_t *cap)
+{
+	CollectWalk(target_ext, cur_dir, paths, count, cap, NULL, NULL);
+}
+
+// Lists the files a #foreach visits once, for all variants to share
+void FileListCollect(char *target_ext)
+{
+	if(gb->file_lists == NULL || HashFind(gb->file_lists, (uint8_t*) target_ext, strlen(target_ext)) != NULL)
+		return;
+
+	FileList *list = calloc(1, sizeof(FileList));
+
+	size_t cap = 0, dir_cap = 0;
+
+	list->listed_at = time(NULL);
+
+	CollectWalk(target_ext, ".", &list->paths, &list->count, &cap, list, &dir_cap);
+
+	list->mtimes = malloc(list->dir_count * sizeof(int64_t));
+
+	StatMtimes(list->dirs, list->dir_count, list->mtimes);
+
+	HashPut(gb->file_lists, (uint8_t*) target_ext, strlen(target_ext), list);
+}
+
+// Adding or removing a file changes its directory's mtime. A directory
+// changed in the second of the listing may change again without its mtime
+// showing it, so it's taken as stale too
+static int FileListStale(FileList *list)
+{
+	if(list->stale) return 1;
+
+	int64_t *mtimes = malloc(list->dir_count * sizeof(int64_t));
+
+	StatMtimes(list->dirs, list->dir_count, mtimes);
+
+	for(size_t i = 0; i < list->dir_count && !list->stale; i++) {
+		if(mtimes[i] != list->mtimes[i] || mtimes[i] / 1000000000 >= list->listed_at)
+			list->stale = 1;
+	}
+
+	free(mtimes);
+
+	return list->stale;
+}
+
+// A listing that has gone stale isn't returned; the loop then walks the
+// directories itself, as it would without variants
+FileList *FileListGet(char *target_ext)
+{
+	if(gb->file_lists == NULL) return NULL;
+
+	FileList *list = HashFind(gb->file_lists, (uint8_t*) target_ext, strlen(target_ext));
+
+	if(list == NULL || gb->checking)
+		return list;
+
+	return FileListStale(list) ? NULL : list;
+}
+
+// The check pass walks a loop body once, with placeholder loop variables
+void CheckLoop(LexState *state, const char *name, const char *name2)
+{
+	CheckPlaceholder(name);
+
+	if(name2 != NULL)
+		CheckPlaceholder(name2);
+
+	lex = LexStateNew();
+	memcpy(lex, state, sizeof(LexState));
+	PrsBody();
+}
+
+void ExecuteForEachBatch(char *target_ext, int64_t max_files, int64_t max_bytes, LexState *state)
+{
+	size_t count = 0, cap = 0;
+
+	char **paths = NULL;
+
+	FileList *list = FileListGet(target_ext);
+
+	if(list != NULL) {
+		paths = malloc(list->count * sizeof(char*));
+
+		for(count = 0; count < list->count; count++)
+			paths[count] = strdup(list->paths[count]);
+	} else {
+		CollectFiles(target_ext, ".", &paths, &count, &cap);
+	}
+
+	for(size_t i = 0; i < count && !gb->returning;) {
+		size_t len = 0, files = 0, bcap = 0;
+
+		char *batch = NULL;
+
+		while(i < count) {
+			size_t plen = strlen(paths[i]);
+
+			if(files > 0) {
+				if(max_files > 0 && files >= (size_t) max_files) break;
+				if(max_bytes > 0 && len + 1 + plen > (size_t) max_bytes) break;
+			}
+
+			while(bcap < len + plen + 2)
+				batch = Grow(batch, &bcap, 1);
+
+			if(files > 0)
+				batch[len++] = ' ';
+
+			memcpy(&batch[len], paths[i], plen);
+
+			len += plen;
+			batch[len] = 0;
+
+			files++;
+			i++;
+		}
+
+		Variable *var = VariableGet("files");
+
+		if(var == NULL) {
+			var = calloc(1, sizeof(Variable));
+			var->name  = "files";
+			var->value = ValueStringOwn(batch, len);
+
+			VariableNew(var);
+		} else {
+			var->value = ValueStringOwn(batch, len);
+		}
+
+		if(len <= VALUE_INLINE_LEN)
+			free(batch);
+
+		char *item = gb->journal_item;
+		gb->journal_item = ValueStr(&var->value);
+
+		lex = LexStateNew();
+		memcpy(lex, state, sizeof(LexState));
+		PrsBody();
+
+		gb->journal_item = item;
+	}
+
+	for(size_t i = 0; i < count; i++)
+		free(paths[i]);
+
+	free(paths);
+}
+
+void ForEachFile(char *cur_dir, char *name, LexState *state)
+{
+	// Copied, the body may keep them after the caller frees its names
+	Value file = ValueStringCopy(name, strlen(name));
+	Value dir  = ValueStringCopy(cur_dir, strlen(cur_dir));
+
+	Variable *var = VariableGet("file");
+
+	if(var == NULL) {
+		var = calloc(1, sizeof(Variable));
+		var->name  = "file";
+		var->value = file;
+
+		VariableNew(var);
+	} else {
+		var->value = file;
+	}
+
+	var = VariableGet("dir");
+
+	if(var == NULL) {
+		var = calloc(1, sizeof(Variable));
+		var->name  = "dir";
+		var->value = dir;
+
+		VariableNew(var);
+	} else {
+		var->value = dir;
+	}
+
+	char *item = gb->journal_item;
+	gb->journal_item = PathJoin(cur_dir, name);
+
+	lex = LexStateNew();
+	memcpy(lex, state, sizeof(LexState));
+	PrsBody();
+
+	free(gb->journal_item);
+	gb->journal_item = item;
+}
+
+void ExecuteForEach(char *target_ext, char *cur_dir, LexState *state)
+{
+	DIR *dir = opendir(cur_dir);
+	if(dir == NULL) return;
+
+	stats.dirs_scanned++;
 
-	int reverse = 0;
+	struct dirent *ent = readdir(dir);
+	while(ent != NULL && !gb->returning) {
+		stats.entries_scanned++;
 
-	if(AcceptB(TK_LOGICAL_NOT))
-		reverse = 1;
+		if(ent->d_type == DT_REG) {
+			if(ExtMatches(ent->d_name, target_ext))
+				ForEachFile(cur_dir, ent->d_name, state);
+		}
 
-	PrsExpression();
+		if(ent->d_type == DT_DIR) {
+			if(ent->d_name[0] == '.')
+				goto next;
 
-	Value val = PopVal();
+			StringBuilder *builder = StringBuilderNew();
 
-	if(val.type == VT_STRING)
-		ErrorHandle(lex, "A string can't be true / false");
+			StringBuilderAppend(builder, "%s/%s", cur_dir, ent->d_name);
+
+			char *dir_name = StringBuild(builder);
 
-	int is_true = val.type == VT_FLOAT ? (val.cur_float != 0) : (val.cur_int != 0);
+			StringBuilderDelete(builder);
+			ExecuteForEach(target_ext, dir_name, state);
+		}
 
-	if(reverse)
-		is_true = !is_true;
+next:;
+		ent = readdir(dir);
+	}
+}
 
-	Expect(TK_RIGHT_PHAR);
+// Walks a listing from the check pass, in the order ExecuteForEach would
+void ExecuteForEachList(FileList *list, LexState *state)
+{
+	char *cur_dir = NULL;
 
-	if(is_true) {
-		PrsBody();
-		if(AcceptIdentB("else"))
-			SkipBody();
-	} else {
-		SkipBody();
+	for(size_t i = 0; i < list->count && !gb->returning; i++) {
+		char  *path  = list->paths[i];
+		char  *slash = strrchr(path, '/');
+		size_t len   = slash - path;
 
-		if(AcceptIdentB("else")) {
-			PrsBody();
+		// Files of one directory are listed together and share its name
+		if(cur_dir == NULL || strncmp(cur_dir, path, len) != 0 || cur_dir[len] != 0) {
+			free(cur_dir);
+			cur_dir = strndup(path, len);
 		}
+
+		ForEachFile(cur_dir, slash + 1, state);
 	}
+
+	free(cur_dir);
 }
 
-void ExecuteForEach(char *target_ext, char *cur_dir, LexState *state)
+// Visits the files changed since the last successful run, or with
+// removed set the files that run saw and that are gone now
+void ExecuteForEachChanged(char *target_ext, int removed, LexState *state)
 {
-	DIR *dir = opendir(cur_dir);
-	if(dir == NULL) return;
-
-	struct dirent *ent = readdir(dir);
-	while(ent != NULL) {
-		if(ent->d_type == DT_REG) {
-			size_t len = strlen(ent->d_name);
-			char *ext  = calloc(len, 1);
-
-			size_t i   = 0;
-			int dot = 0;
-			for(size_t j = 0; j < len; j++) {
-				if(dot)
-					ext[i++] = ent->d_name[j];
+	size_t count = 0, cap = 0;
 
-				if(ent->d_name[j] == '.') dot = 1;
-			}
+	char **paths = NULL;
 
-			if(strcmp(ext, target_ext) == 0) {
-				Variable *var = VariableGet("file");
+	FileList *list = FileListGet(target_ext);
 
-				if(var == NULL) {
-					var = calloc(1, sizeof(Variable));
-					var->name          = "file";
-					var->value.type    = VT_STRING;
-					var->value.cur_str = ent->d_name;
-					var->value.str_len = len;
+	if(list != NULL) {
+		paths = list->paths;
+		count = list->count;
+	} else {
+		CollectFiles(target_ext, ".", &paths, &count, &cap);
+	}
 
-					VariableNew(var);
-				} else {
-					var->value.type    = VT_STRING;
-					var->value.cur_str = ent->d_name;
-					var->value.str_len = len;
-				}
+	size_t visit_count = 0;
 
-				var = VariableGet("dir");
+	char **visit = NULL;
 
-				if(var == NULL) {
-					var = calloc(1, sizeof(Variable));
-					var->name          = "dir";
-					var->value.type    = VT_STRING;
-					var->value.cur_str = cur_dir;
-					var->value.str_len = strlen(cur_dir);
+	if(removed) {
+		visit = SnapshotRemoved(target_ext, paths, count, &visit_count);
+	} else {
+		int *changed = malloc(count * sizeof(int));
 
-					VariableNew(var);
-				} else {
-					var->value.type    = VT_STRING;
-					var->value.cur_str = cur_dir;
-					var->value.str_len = strlen(cur_dir);
-				}
+		SnapshotChanged(target_ext, paths, count, changed);
 
+		visit = malloc(count * sizeof(char*));
 
-				lex = LexStateNew();
-				memcpy(lex, state, sizeof(LexState));
-				PrsBody();
-			}
+		for(size_t i = 0; i < count; i++) {
+			if(changed[i])
+				visit[visit_count++] = paths[i];
 		}
 
-		if(ent->d_type == DT_DIR) {
-			if(ent->d_name[0] == '.')
-				goto next;
+		free(changed);
+	}
 
-			StringBuilder *builder = StringBuilderNew();
+	size_t i = 0;
 
-			StringBuilderAppend(builder, "%s/%s", cur_dir, ent->d_name);
+	for(; i < visit_count && !gb->returning; i++) {
+		char *slash = strrchr(visit[i], '/');
 
-			char *dir_name = StringBuild(builder);
+		if(slash == NULL) {
+			ForEachFile(".", visit[i], state);
+		} else {
+			char *cur_dir = strndup(visit[i], slash - visit[i]);
 
-			StringBuilderDelete(builder);
-			ExecuteForEach(target_ext, dir_name, state);
+			ForEachFile(cur_dir, slash + 1, state);
+
+			free(cur_dir);
 		}
+	}
 
-next:;
-		ent = readdir(dir);
+	// Files a returning loop didn't get to are still changed next time
+	if(!removed) {
+		for(; i < visit_count; i++)
+			SnapshotForget(visit[i]);
+	}
+
+	free(visit);
+
+	if(list == NULL) {
+		for(size_t j = 0; j < count; j++)
+			free(paths[j]);
+
+		free(paths);
 	}
 }
 
@@ -719,10 +2429,10 @@ void ExecuteForEachLine(char *file, LexState *state)
 	char *buf  = malloc(256);
 	size_t len = 0;
 
-	while(!feof(f)) {
+	while(!feof(f) && !gb->returning) {
 		size_t bytes = fread(buf, 1, 256, f);
 
-		for(size_t i = 0; i < bytes; i++) {
+		for(size_t i = 0; i < bytes && !gb->returning; i++) {
 			if(buf[i] == '\n') {
 foreachline:;
 				char *line = StringBuild(builder);
@@ -731,23 +2441,24 @@ foreachline:;
 
 				if(var == NULL) {
 					var = calloc(1, sizeof(Variable));
-					var->name          = "line";
-					var->value.type    = VT_STRING;
-					var->value.cur_str = line;
-					var->value.str_len = len;
+					var->name  = "line";
+					var->value = ValueStringOwn(line, len);
 
 					VariableNew(var);
 				} else {
-					var->value.type    = VT_STRING;
-					var->value.cur_str = line;
-					var->value.str_len = len;
+					var->value = ValueStringOwn(line, len);
 				}
 
 
+				char *item = gb->journal_item;
+				gb->journal_item = line;
+
 				lex = LexStateNew();
 				memcpy(lex, state, sizeof(LexState));
 				PrsBody();
 
+				gb->journal_item = item;
+
 				len = 0;
 				StringBuilderDelete(builder);
 				builder = StringBuilderNew();
@@ -758,13 +2469,116 @@ foreachline:;
 		}
 	}
 
-	if(len > 0)
+	if(len > 0 && !gb->returning)
 		goto foreachline;
 
 	free(buf);
 	StringBuilderDelete(builder);
 }
 
+size_t PrsFSArgs(Value *args, size_t min, size_t max, int *recursive)
+{
+	Expect(TK_LEFT_PHAR);
+
+	size_t count = 0;
+
+	do {
+		PrsExpression();
+
+		Value val = PopVal();
+
+		if(!TypeIs(&val, VT_STRING))
+			ErrorHandle(lex, "File name must be a string");
+
+		if(strcmp(ValueStr(&val), "-r") == 0 && recursive != NULL) {
+			*recursive = 1;
+			continue;
+		}
+
+		if(count == max)
+			ErrorHandle(lex, "Too many arguments");
+
+		args[count++] = val;
+	} while(AcceptB(TK_COMMA));
+
+	Expect(TK_RIGHT_PHAR);
+	Expect(TK_SEMICOLON);
+
+	if(count < min)
+		ErrorHandle(lex, "Too few arguments");
+
+	return count;
+}
+
+void PrsFS(const char *op)
+{
+	Value args[2];
+	int recursive = 0;
+
+	int pair    = strcmp(op, "copy") == 0 || strcmp(op, "move") == 0;
+	int allow_r = strcmp(op, "rm") == 0   || strcmp(op, "copy") == 0;
+
+	size_t count = PrsFSArgs(args, pair + 1, pair + 1, allow_r ? &recursive : NULL);
+
+	char *path = ValueStr(&args[0]);
+
+	if(gb->checking)
+		return;
+
+	if(gb->dry_run) {
+		if(count > 1)
+			printf("#%s %s %s\n", op, path, ValueStr(&args[1]));
+		else
+			printf("#%s %s\n", op, path);
+		return;
+	}
+
+	if(strcmp(op, "mkdir") == 0) {
+		FSMkdir(path);
+		return;
+	} else if(strcmp(op, "touch") == 0) {
+		FSTouch(path);
+		return;
+	}
+
+	glob_t g;
+
+	if(glob(path, GLOB_NOSORT, NULL, &g) != 0) {
+		if(strcmp(op, "copy") == 0 || strcmp(op, "move") == 0)
+			printf("gbuild: %s: %s: No such file or directory\n", op, path);
+		return;
+	}
+
+	char *dst = count > 1 ? ValueStr(&args[1]) : NULL;
+
+	struct stat s;
+
+	int into_dir = dst != NULL && stat(dst, &s) == 0 && S_ISDIR(s.st_mode);
+
+	for(size_t i = 0; i < g.gl_pathc; i++) {
+		char *src = g.gl_pathv[i];
+
+		if(strcmp(op, "rm") == 0) {
+			FSRemove(src, recursive);
+		} else if(strcmp(op, "rmdir") == 0) {
+			FSRmdir(src);
+		} else {
+			char *base   = strrchr(src, '/');
+			char *target = into_dir ? PathJoin(dst, base ? base + 1 : src) : dst;
+
+			if(strcmp(op, "copy") == 0)
+				FSCopy(src, target, recursive);
+			else
+				FSMove(src, target);
+
+			if(into_dir)
+				free(target);
+		}
+	}
+
+	globfree(&g);
+}
+
 void PrsBuiltin()
 {
 	Expect(TK_SQUARE);
@@ -779,13 +2593,17 @@ void PrsBuiltin()
 
 		Value val = PopVal();
 
-		if(val.type != VT_INT)
+		if(!TypeIs(&val, VT_INT))
 			ErrorHandle(lex, "#exit expects integer value");
 
 		if(val.cur_int < 0)
 			val.cur_int = -val.cur_int;
 
-		exit(val.cur_int % 256);
+		if(!gb->checking)
+			ScriptExit(val.cur_int % 256);
+
+		AcceptB(TK_SEMICOLON);
+		return;
 	} else if(AcceptIdentB("foreach")) {
 		if(VariableGet("file") != NULL)
 			ErrorHandle(lex, "The variable 'file' is used by #foreach");
@@ -802,7 +2620,49 @@ void PrsBuiltin()
 		LexState *saved = lex;
 
 		ScopePush();
-		ExecuteForEach(ext, ".", saved);
+
+		FileList *list = FileListGet(ext);
+
+		if(gb->checking) {
+			FileListCollect(ext);
+			CheckLoop(saved, "file", "dir");
+		} else if(list != NULL) {
+			ExecuteForEachList(list, saved);
+		} else {
+			ExecuteForEach(ext, ".", saved);
+		}
+
+		ScopePop();
+
+		lex = saved;
+		SkipBody();
+		return;
+	} else if(AcceptIdentB("foreach_changed") || AcceptIdentB("foreach_removed")) {
+		int removed = strcmp(lexl->cur_str, "foreach_removed") == 0;
+
+		if(VariableGet("file") != NULL)
+			ErrorHandle(lex, "The variable 'file' is used by #foreach");
+		if(VariableGet("dir") != NULL)
+			ErrorHandle(lex, "The variable 'dir' is used by #foreach");
+
+		Expect(TK_LEFT_PHAR);
+		Expect(TK_STRING);
+
+		char *ext = lexl->cur_str;
+
+		Expect(TK_RIGHT_PHAR);
+
+		LexState *saved = lex;
+
+		ScopePush();
+
+		if(gb->checking) {
+			FileListCollect(ext);
+			CheckLoop(saved, "file", "dir");
+		} else {
+			ExecuteForEachChanged(ext, removed, saved);
+		}
+
 		ScopePop();
 
 		lex = saved;
@@ -822,12 +2682,117 @@ void PrsBuiltin()
 		LexState *saved = lex;
 
 		ScopePush();
-		ExecuteForEachLine(name, saved);
+
+		if(gb->checking)
+			CheckLoop(saved, "line", NULL);
+		else
+			ExecuteForEachLine(name, saved);
+
+		ScopePop();
+
+		lex = saved;
+		SkipBody();
+		return;
+	} else if(AcceptIdentB("foreach_batch")) {
+		if(VariableGet("files") != NULL)
+			ErrorHandle(lex, "The variable 'files' is used by #foreach_batch");
+
+		Expect(TK_LEFT_PHAR);
+		Expect(TK_STRING);
+
+		char *ext = lexl->cur_str;
+
+		Expect(TK_COMMA);
+
+		PrsExpression();
+
+		Value max_files = PopVal();
+		Value max_bytes = { .type = VT_INT, .cur_int = 0 };
+
+		if(AcceptB(TK_COMMA)) {
+			PrsExpression();
+			max_bytes = PopVal();
+		}
+
+		if(!TypeIs(&max_files, VT_INT) || !TypeIs(&max_bytes, VT_INT))
+			ErrorHandle(lex, "#foreach_batch expects integer limits");
+
+		if(max_files.cur_int <= 0 && max_bytes.cur_int <= 0)
+			ValueError(lex, "#foreach_batch needs a file or byte limit");
+
+		Expect(TK_RIGHT_PHAR);
+
+		LexState *saved = lex;
+
+		ScopePush();
+
+		if(gb->checking) {
+			FileListCollect(ext);
+			CheckLoop(saved, "files", NULL);
+		} else {
+			ExecuteForEachBatch(ext, max_files.cur_int, max_bytes.cur_int, saved);
+		}
+
 		ScopePop();
 
 		lex = saved;
 		SkipBody();
 		return;
+	} else if(AcceptIdentB("include")) {
+		Expect(TK_LEFT_PHAR);
+
+		size_t argc = 0, cap = 0;
+
+		Value *args = NULL;
+
+		do {
+			PrsExpression();
+
+			if(argc == cap)
+				args = Grow(args, &cap, sizeof(Value));
+
+			args[argc] = PopVal();
+
+			if(!TypeIs(&args[argc++], VT_STRING))
+				ErrorHandle(lex, "#include expects string arguments");
+		} while(AcceptB(TK_COMMA));
+
+		Expect(TK_RIGHT_PHAR);
+		Expect(TK_SEMICOLON);
+
+		char **argv = malloc(argc * sizeof(char*));
+
+		for(size_t i = 0; i < argc; i++)
+			argv[i] = ValueStr(&args[i]);
+
+		Module *mod = ModuleLoad(argv[0]);
+
+		if(mod == NULL)
+			ValueError(lex, "Can't read included file");
+		else
+			ExecuteInclude(mod, argc, argv);
+
+		free(argv);
+		free(args);
+		return;
+	} else if(AcceptIdentB("mkdir")) {
+		PrsFS("mkdir");
+		return;
+	} else if(AcceptIdentB("rm")) {
+		PrsFS("rm");
+		return;
+	} else if(AcceptIdentB("rmdir")) {
+		PrsFS("rmdir");
+		return;
+	} else if(AcceptIdentB("copy")) {
+		PrsFS("copy");
+		return;
+	} else if(AcceptIdentB("move")) {
+		PrsFS("move");
+		return;
+	} else if(AcceptIdentB("touch")) {
+		PrsFS("touch");
+		return;
 	}
 
 	ErrorHandle(lex, "Unknown builtin");
@@ -835,11 +2800,17 @@ void PrsBuiltin()
 
 void PrsStatement()
 {
+	stats.statements++;
+
 	if(AcceptIdent("let")) {
 		PrsVarDecl();
 		Expect(TK_SEMICOLON);
 	} else if(AcceptIdent("if")) {
 		PrsIf();
+	} else if(AcceptIdent("fn") || AcceptIdent("pure")) {
+		PrsFunction();
+	} else if(AcceptIdent("return")) {
+		PrsReturn();
  	} else if(Accept(TK_LEFT_CURLY)) {
 		PrsBody();
 	} else if(Accept(TK_SQUARE)) {
@@ -858,67 +2829,143 @@ void Parse()
 	}
 }
 
-int main(int argc, char **argv)
+static int Eval(Module *mod, int argc, char **argv)
 {
-	const char *file_name = "GBuildFile";
+	gb->script_argc   = argc;
+	gb->script_argv   = argv;
+	gb->dry_run_count = 0;
 
-	if(argc > 1) {
-		const char *arg = argv[argc-1];
+	if(gb->check && CheckModule(mod, argc, argv) != 0)
+		return 1;
 
-		if(strlen(arg) > 2) {
-			if(memcmp(arg, "f:", 2) == 0)
-				file_name = &arg[2];
-		}
+	SnapshotBegin();
+
+	if(gb->dry_run) {
+		int status = ExitStatus(ExecuteModule(mod, argc, argv));
+
+		SnapshotEnd(status);
+		return status;
 	}
 
-	File *f = FileRead(file_name);
+	JournalBegin();
+
+	int status = ExecuteModule(mod, argc, argv);
+
+	JournalEnd(status);
+	SnapshotEnd(status);
+	MemoEnd(status);
+
+	return status;
+}
+
+// Variants share the loaded module and one check pass, which also lists
+// the files each #foreach visits; every variant then runs in a process
+// of its own
+static int EvalVariants(Module *mod, int argc, char **argv)
+{
+	gb->script_argc = argc;
+	gb->script_argv = argv;
+	gb->variant     = &gb->variants[0];
+
+	// Listings are only good for the run that made them
+	if(gb->file_lists != NULL)
+		HashMapDelete(gb->file_lists);
+
+	gb->file_lists = HashMapNew(64, HashDefaultFunction);
 
-	if(f->data == NULL || f->size == 0) {
-		printf("gbuild: fatal error: Can't read %s\n", file_name);
+	if(gb->check && CheckModule(mod, argc, argv) != 0)
 		return 1;
-	}
 
-	char *fbuf = calloc(f->size + 1, 1);
-	memcpy(fbuf, f->data, f->size);
-	fbuf[f->size] = '\0';
+	pid_t *pids = malloc(gb->variant_count * sizeof(pid_t));
 
+	int stats_fds[2];
 
-	LexState *l = LexStateNew();
-	lexp = &l;
+	StatsPipe(stats_fds);
 
-	lex->source  = fbuf;
-	lex->skip_ws = 1;
-	lex->buf     = calloc(f->size, 1);
-	lex->error   = ErrorHandler;
+	fflush(stdout);
 
-	ScopePush();
+	for(size_t i = 0; i < gb->variant_count; i++) {
+		pids[i] = fork();
 
-	for(int i = 0; i < argc; i++) {
-		Variable *var = calloc(1, sizeof(Variable));
+		if(pids[i] == 0) {
+			gb->variant = &gb->variants[i];
 
-		StringBuilder *builder = StringBuilderNew();
+			RemoteForget();
+			MemoForget();
 
-		StringBuilderAppend(builder, "arg%d", i);
+			// The check pass was counted by the parent
+			stats = (Stats) { 0 };
 
-		var->name = StringBuild(builder);
+			close(stats_fds[0]);
 
-		StringBuilderDelete(builder);
+			// Variants write at the same time, keep their lines whole
+			setvbuf(stdout, NULL, _IOLBF, 0);
 
-		var->value.type    = VT_STRING;
-		var->value.cur_str = argv[i];
-		var->value.str_len = strlen(argv[i]);
+			int code = Eval(mod, argc, argv);
 
-		VariableNew(var);
+			StatsSend(stats_fds[1]);
+			exit(code);
+		}
 	}
 
-	Variable *var = calloc(1, sizeof(Variable));
+	int status = 0;
 
-	var->name          = strdup("argc");
-	var->value.type    = VT_INT;
-	var->value.cur_int = argc;
+	for(size_t i = 0; i < gb->variant_count; i++) {
+		int ws, code = 1;
 
-	VariableNew(var);
+		if(pids[i] > 0 && waitpid(pids[i], &ws, 0) == pids[i] && WIFEXITED(ws))
+			code = WEXITSTATUS(ws);
 
-	Parse();
-	ScopePop();
+		if(code != 0)
+			printf("gbuild: error: Variant '%s' failed\n", gb->variants[i].name);
+
+		if(code > status)
+			status = code;
+
+		StatsCollect(stats_fds[0]);
+	}
+
+	if(stats_fds[0] >= 0) {
+		close(stats_fds[0]);
+		close(stats_fds[1]);
+	}
+
+	free(pids);
+
+	gb->variant = NULL;
+
+	return status;
+}
+
+int GBuildEval(GBuild *ctx, const char *path, int argc, char **argv)
+{
+	GBuild *outer = gb;
+	gb = ctx;
+
+	Module *mod = ModuleLoad(path);
+
+	int status = 1;
+
+	if(mod == NULL)
+		printf("gbuild: fatal error: Can't read %s\n", path);
+	else if(gb->variant_count > 0)
+		status = EvalVariants(mod, argc, argv);
+	else
+		status = Eval(mod, argc, argv);
+
+	gb = outer;
+
+	return status;
+}
+
+int GBuildEvalSource(GBuild *ctx, const char *name, const char *source, int argc, char **argv)
+{
+	GBuild *outer = gb;
+	gb = ctx;
+
+	int status = Eval(ModuleNew(name, source, strlen(source)), argc, argv);
+
+	gb = outer;
+
+	return status;
 }
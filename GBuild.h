@@ -1,10 +1,41 @@
 #pragma once
 
 #include <G64/G64.h>
+#include <setjmp.h>
+#include "GBuildLib.h"
 
-extern LexState **lexp;
+// The interpreter running on this thread
+extern _Thread_local GBuild *gb;
 
-#define lex (*lexp)
+// Counters for --stats, kept per thread. Only work the interpreter does
+// itself is counted, what happens inside G64 isn't seen
+typedef struct
+{
+	uint64_t statements;
+	uint64_t var_lookups;
+	uint64_t var_news;
+	uint64_t stat_calls;
+	uint64_t dirs_scanned;
+	uint64_t entries_scanned;
+	uint64_t processes;
+	uint64_t string_bytes;
+} Stats;
+
+extern _Thread_local Stats stats;
+
+void StatsPrint();
+
+// Processes forked for subdirs and variants send their counters back to
+// the parent through a pipe, one record each
+int StatsPipe(int fds[2]);
+
+void StatsSend(int fd);
+
+void StatsCollect(int fd);
+
+#define lexp (&gb->state)
+
+#define lex (gb->state)
 
 #define lexl (lex->last)
 
@@ -12,14 +43,24 @@ extern LexState **lexp;
 #define VT_FLOAT  1
 #define VT_STRING 2
 
+// Only in the check pass, for a value whose type depends on the branch
+// taken at run time; it passes wherever a type is expected
+#define VT_UNKNOWN 3
+
+// Strings up to this length are stored inside the value itself
+#define VALUE_INLINE_LEN 15
+
 typedef struct
 {
-	int type;
+	uint32_t type;
+	uint32_t str_len;
 
-	int64_t  cur_int;
-	double cur_float;
-	char    *cur_str;
-	size_t   str_len;
+	union {
+		int64_t  cur_int;
+		double cur_float;
+		char    *cur_str;
+		char     inline_str[VALUE_INLINE_LEN + 1];
+	};
 } Value;
 
 typedef struct
@@ -28,14 +69,301 @@ typedef struct
 	Value value;
 } Variable;
 
+void *Grow(void *ptr, size_t *cap, size_t size);
+
+int RunCommand(const char *cmd);
+
+char *RunCapture(const char *cmd, size_t *len, int *status);
+
+uint64_t Hash64(const uint8_t *data, size_t len);
+
+int FileHash(const char *path, uint64_t *hash);
+
+char *PathJoin(const char *dir, const char *name);
+
+int ExtMatches(const char *name, const char *target_ext);
+
+int FSMkdir(const char *path);
+
+int FSRemove(const char *path, int recursive);
+
+int FSRmdir(const char *path);
+
+int FSCopy(const char *src, const char *dst, int recursive);
+
+int FSMove(const char *src, const char *dst);
+
+int FSTouch(const char *path);
+
+typedef struct
+{
+	int64_t  mtime;
+	int64_t  size;
+	uint64_t ino;
+} FileStat;
+
+// mtime is in nanoseconds, or -1 when the path can't be read
+void StatFiles(char **paths, size_t count, FileStat *out);
+
+// Fills mtimes with each path's modification time in nanoseconds, or -1
+// when the path can't be read
+void StatMtimes(char **paths, size_t count, int64_t *mtimes);
+
+void JournalBegin();
+
+int JournalReplay(const char *cmd);
+
+void JournalRecord(const char *cmd, int status);
+
+void JournalEnd(int status);
+
+void JournalDetach();
+
+typedef struct Snapshot Snapshot;
+
+void SnapshotBegin();
+
+// Flags the paths that were added or modified since the last successful
+// run; every path scanned goes into the snapshot of this run
+void SnapshotChanged(const char *ext, char **paths, size_t count, int *changed);
+
+// Leaves a path out of the snapshot, so the next run sees it as changed
+void SnapshotForget(const char *path);
+
+// Returns the paths of the last successful run that aren't in paths
+char **SnapshotRemoved(const char *ext, char **paths, size_t count, size_t *removed);
+
+// The snapshot is only saved for runs that succeeded
+void SnapshotEnd(int status);
+
+Value *MemoFind(uint64_t key);
+
+void MemoStore(uint64_t key, Value *val);
+
+// Drops the entries this run didn't use once they make up most of the file
+void MemoEnd(int status);
+
+void MemoForget();
+
+typedef struct BraceTable BraceTable;
+
+typedef struct
+{
+	char       *path;
+	char       *source;
+	LexState   *start;
+	BraceTable *braces;
+	int64_t   mtime_sec;
+	int64_t   mtime_nsec;
+	int       checked;
+} Module;
+
+Module *ModuleNew(const char *path, const char *source, size_t size);
+
+Module *ModuleLoad(const char *path);
+
+void ModuleAlias(const char *path, Module *mod);
+
+void ModuleForget(Module *mod);
+
+Module *ModuleLoadGuarded(const char *path);
+
+void ModuleEnter(Module *mod);
+
+#define FR_CWD   0
+#define FR_ENV   1
+#define FR_INPUT 2
+#define FR_CMD   3
+#define FR_NEED  4
+#define FR_DATA  5
+#define FR_OUT   6
+#define FR_ERR   7
+#define FR_EXIT  8
+#define FR_ARG   9
+#define FR_RUN   10
+#define FR_AUTH  11
+#define FR_WANT  12
+#define FR_FILE  13
+
+int WriteAll(int fd, const void *data, size_t len);
+
+int FrameSend(int fd, int type, const void *data, size_t len);
+
+char *FrameRecv(int fd, int *type, size_t *len);
+
+int SocketConnect(const char *addr);
+
+int SocketListen(const char *addr);
+
+// Runs run(arg) in a child process and relays its stdout and stderr over
+// fd, returns the child's exit status
+int StreamRun(int fd, void (*run)(void *arg), void *arg);
+
+int WorkerMain(const char *addr);
+
+int ServerMain(const char *path);
+
+int ClientMain(const char *path, int argc, char **argv, int *status);
+
+const char *ScriptName(int argc, char **argv);
+
+int CommandMain(GBuild *ctx, int argc, char **argv);
+
+void RemoteRun(const char *cmd, char **inputs, size_t input_count, char **outputs, size_t output_count);
+
+void RemoteDrain();
+
+void RemoteForget();
+
+int64_t RemoteWait();
+
+typedef struct
+{
+	Variable **vars;
+	size_t     var_count;
+	size_t     var_cap;
+	char     **functions;
+	size_t     function_count;
+	size_t     function_cap;
+} Scope;
+
+typedef struct
+{
+	HashMap *map;
+	size_t   buckets;
+	size_t   total;
+	Scope   *scopes;
+	size_t   scope_cap;
+	size_t   scope_top;
+	HashMap *functions;
+} VarTable;
+
+// A named configuration; its keys are declared as variables in every
+// script frame and override top level lets of the same name
+typedef struct
+{
+	char   *name;
+	char  **keys;
+	char  **values;
+	size_t  count;
+	size_t  cap;
+} Variant;
+
+// The files of one extension, and the directories walked for them with
+// their mtimes, so a listing can tell when it has gone stale
+typedef struct
+{
+	char   **paths;
+	size_t   count;
+	char   **dirs;
+	int64_t *mtimes;
+	size_t   dir_count;
+	int64_t  listed_at;
+	int      stale;
+} FileList;
+
+struct GBuild
+{
+	LexState *state;
+	Module   *module;
+	HashMap  *modules;
+
+	VarTable  vars;
+
+	uint8_t  *ws_stack;
+	size_t    ws_cap;
+	size_t    ws_top;
+
+	Value    *val_stack;
+	size_t    val_cap;
+	size_t    val_top;
+
+	// Statements inside a function body only clear the stack down to here
+	size_t    val_base;
+
+	int       call_depth;
+	int       returning;
+	int       has_ret;
+	Value     ret;
+
+	int       dry_run;
+	int64_t   dry_run_count;
+
+	// check runs the check pass before a script, checking is set during it
+	int       check;
+	int       checking;
+
+	// Finished commands are journaled so an interrupted run can resume;
+	// journal_item names the loop iteration they ran in
+	int       resume;
+	int       journal_fd;
+	HashMap  *journal;
+	char     *journal_item;
+
+	// Files #foreach_changed saw in the last successful run and this one
+	Snapshot *snapshot;
+
+	int       script_argc;
+	char    **script_argv;
+
+	// Variants run in their own processes; file_lists holds the #foreach
+	// listings the check pass made for them to share
+	Variant  *variants;
+	size_t    variant_count;
+	size_t    variant_cap;
+	Variant  *variant;
+	HashMap  *file_lists;
+
+	// Where #exit and script errors unwind to, NULL exits the process
+	jmp_buf  *exit_jmp;
+
+	// A module whose braces are being matched, for a lexical error to
+	// leave behind
+	Module   *loading;
+};
+
+void ScriptExit(int status);
+
+typedef struct Frame Frame;
+
+Frame *FramePush();
+
+void FramePop(Frame *frame);
+
+void DeclareArgs(int argc, char **argv);
+
+void DeclareVariant();
+
+const char *VariantValue(const char *name);
+
+const char *VariantPath(const char *file);
+
 void ScopePush();
 
 void ScopePop();
 
 void VariableNew(Variable *var);
 
+void FunctionNew(char *name, void *fn);
+
 Variable *VariableGet(const char *name);
 
+void VariableRestore(Variable *var);
+
+Value *VariablesSave(size_t *count);
+
+void VariablesRestore(Value *saved);
+
+void VariablesJoin(Value *other);
+
+BraceTable *BraceTableNew();
+
+void BraceTableBuild(BraceTable *table, LexState *state);
+
+void BraceTableFree(BraceTable *table);
+
+int BraceSkip();
+
 void WSPush();
 
 void WSPop();
@@ -48,6 +376,21 @@ Value PeekVal();
 
 double ValueNum(Value *val);
 
+Value ValueString(char *str, size_t len);
+
+Value ValueStringCopy(const char *str, size_t len);
+
+Value ValueStringOwn(char *str, size_t len);
+
+char *ValueStr(Value *val);
+
+// Large enough for any number printed by ValueText
+#define VALUE_TEXT_LEN 512
+
+char *ValueText(Value *val, char *num, size_t *len);
+
+char *ValueKeyText(Value *val, char *num, size_t *len);
+
 void PushInt(int64_t num);
 
 int64_t PopInt();
@@ -58,10 +401,18 @@ double PopFloat();
 
 void PushString(char *str);
 
+void PushStringCopy(const char *str, size_t len);
+
+void PushStringOwn(char *str, size_t len);
+
 char *PopString();
 
 void ClearVal();
 
+void ErrorHandler(LexState *l, int64_t tok);
+
+void Parse();
+
 void Expect(int64_t token);
 
 void ExpectIdent(const char *str);
@@ -0,0 +1,392 @@
+#define _GNU_SOURCE
+#include "GBuild.h"
+#include <G64/G64.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <ftw.h>
+#include <pthread.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+typedef struct
+{
+	dev_t   dev;
+	ino_t   ino;
+	off_t   size;
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+} FileKey;
+
+// Shared by every interpreter in the process
+static HashMap *file_hashes = NULL;
+
+static pthread_mutex_t file_hashes_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int FileHash(const char *path, uint64_t *hash)
+{
+	int fd = open(path, O_RDONLY);
+	if(fd < 0) return 0;
+
+	struct stat s;
+
+	if(fstat(fd, &s) != 0 || !S_ISREG(s.st_mode)) {
+		close(fd);
+		return 0;
+	}
+
+	FileKey key;
+	memset(&key, 0, sizeof(FileKey));
+
+	key.dev        = s.st_dev;
+	key.ino        = s.st_ino;
+	key.size       = s.st_size;
+	key.mtime_sec  = s.st_mtim.tv_sec;
+	key.mtime_nsec = s.st_mtim.tv_nsec;
+
+	pthread_mutex_lock(&file_hashes_lock);
+
+	if(file_hashes == NULL)
+		file_hashes = HashMapNew(1024, HashDefaultFunction);
+
+	uint64_t *known = HashFind(file_hashes, (uint8_t*) &key, sizeof(FileKey));
+
+	pthread_mutex_unlock(&file_hashes_lock);
+
+	if(known != NULL) {
+		close(fd);
+		*hash = *known;
+		return 1;
+	}
+
+	if(s.st_size == 0) {
+		*hash = Hash64(NULL, 0);
+	} else {
+		void *data = mmap(NULL, s.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+		if(data == MAP_FAILED) {
+			close(fd);
+			return 0;
+		}
+
+		madvise(data, s.st_size, MADV_SEQUENTIAL);
+
+		*hash = Hash64(data, s.st_size);
+
+		munmap(data, s.st_size);
+	}
+
+	close(fd);
+
+	known  = malloc(sizeof(uint64_t));
+	*known = *hash;
+
+	pthread_mutex_lock(&file_hashes_lock);
+	HashPut(file_hashes, (uint8_t*) &key, sizeof(FileKey), known);
+	pthread_mutex_unlock(&file_hashes_lock);
+
+	return 1;
+}
+
+char *PathJoin(const char *dir, const char *name)
+{
+	size_t dlen = strlen(dir);
+	size_t nlen = strlen(name);
+
+	char *path = malloc(dlen + nlen + 2);
+
+	memcpy(path, dir, dlen);
+	path[dlen] = '/';
+	memcpy(&path[dlen + 1], name, nlen + 1);
+
+	return path;
+}
+
+static void FSError(const char *op, const char *path)
+{
+	printf("gbuild: %s: %s: %s\n", op, path, strerror(errno));
+}
+
+int FSMkdir(const char *path)
+{
+	if(*path == 0) {
+		errno = ENOENT;
+		FSError("mkdir", path);
+		return 1;
+	}
+
+	char *tmp = strdup(path);
+
+	for(char *p = tmp + 1; *p; p++) {
+		if(*p != '/') continue;
+
+		*p = 0;
+
+		if(mkdir(tmp, 0777) != 0 && errno != EEXIST) {
+			FSError("mkdir", tmp);
+			free(tmp);
+			return 1;
+		}
+
+		*p = '/';
+	}
+
+	free(tmp);
+
+	if(mkdir(path, 0777) != 0 && errno != EEXIST) {
+		FSError("mkdir", path);
+		return 1;
+	}
+
+	return 0;
+}
+
+static int FSRemoveEntry(const char *path, const struct stat *s, int type, struct FTW *ftw)
+{
+	(void) s;
+	(void) ftw;
+
+	int r = type == FTW_DP ? rmdir(path) : unlink(path);
+
+	if(r != 0 && errno != ENOENT)
+		FSError("rm", path);
+
+	return 0;
+}
+
+int FSRemove(const char *path, int recursive)
+{
+	struct stat s;
+
+	if(lstat(path, &s) != 0)
+		return 0;
+
+	if(S_ISDIR(s.st_mode)) {
+		if(!recursive) {
+			errno = EISDIR;
+			FSError("rm", path);
+			return 1;
+		}
+
+		nftw(path, FSRemoveEntry, 64, FTW_DEPTH | FTW_PHYS);
+		return lstat(path, &s) == 0;
+	}
+
+	if(unlink(path) != 0 && errno != ENOENT) {
+		FSError("rm", path);
+		return 1;
+	}
+
+	return 0;
+}
+
+int FSRmdir(const char *path)
+{
+	if(rmdir(path) != 0 && errno != ENOENT) {
+		FSError("rmdir", path);
+		return 1;
+	}
+
+	return 0;
+}
+
+static int FSCopyFile(const char *src, const char *dst, mode_t mode)
+{
+	int in = open(src, O_RDONLY);
+
+	if(in < 0) {
+		FSError("copy", src);
+		return 1;
+	}
+
+	struct stat from, to;
+
+	// Truncating the destination would empty the source
+	if(fstat(in, &from) == 0 && stat(dst, &to) == 0 && from.st_dev == to.st_dev && from.st_ino == to.st_ino) {
+		printf("gbuild: copy: %s and %s are the same file\n", src, dst);
+		close(in);
+		return 1;
+	}
+
+	int out = open(dst, O_WRONLY | O_CREAT | O_TRUNC, mode & 07777);
+
+	if(out < 0) {
+		FSError("copy", dst);
+		close(in);
+		return 1;
+	}
+
+	int ret = 0;
+
+	// Try a reflink first, then let the kernel copy the data, and only read
+	// it through userspace if neither is supported
+	if(ioctl(out, FICLONE, in) != 0) {
+		ssize_t n;
+
+		do {
+			n = copy_file_range(in, NULL, out, NULL, 1 << 30, 0);
+		} while(n > 0);
+
+		if(n < 0) {
+			char buf[65536];
+
+			lseek(in,  0, SEEK_SET);
+			lseek(out, 0, SEEK_SET);
+
+			if(ftruncate(out, 0) != 0)
+				n = -1;
+
+			while(n != -1 && (n = read(in, buf, sizeof(buf))) > 0) {
+				if(write(out, buf, n) != n)
+					n = -1;
+			}
+
+			if(n < 0) {
+				FSError("copy", dst);
+				ret = 1;
+			}
+		}
+	}
+
+	close(in);
+	close(out);
+
+	return ret;
+}
+
+static int FSCopyTree(const char *src, const char *dst, int recursive)
+{
+	struct stat s;
+
+	if(stat(src, &s) != 0) {
+		FSError("copy", src);
+		return 1;
+	}
+
+	if(!S_ISDIR(s.st_mode))
+		return FSCopyFile(src, dst, s.st_mode);
+
+	if(!recursive) {
+		errno = EISDIR;
+		FSError("copy", src);
+		return 1;
+	}
+
+	if(mkdir(dst, s.st_mode & 07777) != 0 && errno != EEXIST) {
+		FSError("copy", dst);
+		return 1;
+	}
+
+	DIR *dir = opendir(src);
+
+	if(dir == NULL) {
+		FSError("copy", src);
+		return 1;
+	}
+
+	int ret = 0;
+
+	struct dirent *ent;
+
+	while((ent = readdir(dir)) != NULL) {
+		if(strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
+			continue;
+
+		char *from = PathJoin(src, ent->d_name);
+		char *to   = PathJoin(dst, ent->d_name);
+
+		ret |= FSCopyTree(from, to, 1);
+
+		free(from);
+		free(to);
+	}
+
+	closedir(dir);
+
+	return ret;
+}
+
+// Whether dst is src or somewhere below it. dst itself may not exist yet,
+// so its directory is resolved instead
+static int FSInside(const char *src, const char *dst)
+{
+	char *from = realpath(src, NULL);
+	char *to   = realpath(dst, NULL);
+
+	if(to == NULL && from != NULL) {
+		const char *slash = strrchr(dst, '/');
+
+		char *parent = slash == NULL ? strdup(".") : strndup(dst, slash == dst ? 1 : (size_t) (slash - dst));
+		char *real   = realpath(parent, NULL);
+
+		if(real != NULL)
+			to = PathJoin(real, slash == NULL ? dst : slash + 1);
+
+		free(parent);
+		free(real);
+	}
+
+	size_t len = from ? strlen(from) : 0;
+
+	int inside = from != NULL && to != NULL && strncmp(from, to, len) == 0 && (to[len] == 0 || to[len] == '/' || len == 1);
+
+	free(from);
+	free(to);
+
+	return inside;
+}
+
+int FSCopy(const char *src, const char *dst, int recursive)
+{
+	struct stat s;
+
+	// A directory copied into itself would keep finding the copy
+	if(recursive && stat(src, &s) == 0 && S_ISDIR(s.st_mode) && FSInside(src, dst)) {
+		printf("gbuild: copy: %s is inside %s\n", dst, src);
+		return 1;
+	}
+
+	return FSCopyTree(src, dst, recursive);
+}
+
+int FSMove(const char *src, const char *dst)
+{
+	if(rename(src, dst) == 0)
+		return 0;
+
+	if(errno != EXDEV) {
+		FSError("move", src);
+		return 1;
+	}
+
+	if(FSCopy(src, dst, 1) != 0)
+		return 1;
+
+	return FSRemove(src, 1);
+}
+
+int FSTouch(const char *path)
+{
+	int fd = open(path, O_WRONLY | O_CREAT, 0666);
+
+	if(fd < 0) {
+		FSError("touch", path);
+		return 1;
+	}
+
+	int r = futimens(fd, NULL);
+	close(fd);
+
+	if(r != 0) {
+		FSError("touch", path);
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,167 @@
+#include "GBuild.h"
+#include <G64/G64.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define JOURNAL_FILE ".gbuild_journal"
+
+// Records are "status item_len cmd_len;" + item + cmd + "\n", one per
+// finished command, appended with a single write so a killed run leaves
+// at worst one torn record at the end
+
+static char *JournalKey(const char *item, const char *cmd)
+{
+	size_t ilen = strlen(item);
+	size_t clen = strlen(cmd);
+
+	char *key = malloc(ilen + clen + 2);
+
+	memcpy(key, item, ilen);
+	key[ilen] = '\n';
+	memcpy(&key[ilen + 1], cmd, clen + 1);
+
+	return key;
+}
+
+static void JournalLoad()
+{
+	gb->journal = HashMapNew(1024, HashDefaultFunction);
+
+	File *f = FileRead(VariantPath(JOURNAL_FILE));
+
+	if(f->data == NULL || f->size == 0)
+		return;
+
+	char *data = (char*) f->data;
+	char *end  = data + f->size;
+
+	while(data < end) {
+		int    status;
+		size_t ilen, clen;
+
+		char header[128];
+		size_t hlen = 0;
+
+		while(data + hlen < end && data[hlen] != ';' && hlen < sizeof(header) - 1) {
+			header[hlen] = data[hlen];
+			hlen++;
+		}
+
+		header[hlen] = 0;
+
+		if(sscanf(header, "%d %zu %zu", &status, &ilen, &clen) != 3 || data + hlen + 1 + ilen + clen > end)
+			break;
+
+		data += hlen + 1;
+
+		// Only commands that succeeded are skipped; failed ones run again
+		if(status == 0) {
+			char *key = malloc(ilen + clen + 2);
+
+			memcpy(key, data, ilen);
+			key[ilen] = '\n';
+			memcpy(&key[ilen + 1], &data[ilen], clen);
+			key[ilen + clen + 1] = 0;
+
+			int64_t *count = HashFind(gb->journal, (uint8_t*) key, strlen(key));
+
+			if(count == NULL) {
+				count = calloc(1, sizeof(int64_t));
+				HashPut(gb->journal, (uint8_t*) key, strlen(key), count);
+			} else {
+				free(key);
+			}
+
+			(*count)++;
+		}
+
+		data += ilen + clen + 1;
+	}
+}
+
+void JournalBegin()
+{
+	gb->journal_fd = -1;
+
+	if(gb->resume)
+		JournalLoad();
+	else
+		unlink(VariantPath(JOURNAL_FILE));
+}
+
+int JournalReplay(const char *cmd)
+{
+	if(gb->journal == NULL) return 0;
+
+	char *key = JournalKey(gb->journal_item ? gb->journal_item : "-", cmd);
+
+	int64_t *count = HashFind(gb->journal, (uint8_t*) key, strlen(key));
+
+	free(key);
+
+	if(count == NULL || *count == 0)
+		return 0;
+
+	(*count)--;
+
+	return 1;
+}
+
+void JournalRecord(const char *cmd, int status)
+{
+	if(gb->journal_fd < 0)
+		gb->journal_fd = open(VariantPath(JOURNAL_FILE), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+
+	if(gb->journal_fd < 0) return;
+
+	const char *item = gb->journal_item ? gb->journal_item : "-";
+
+	size_t ilen = strlen(item);
+	size_t clen = strlen(cmd);
+
+	char header[64];
+	int  hlen = snprintf(header, sizeof(header), "%d %zu %zu;", status, ilen, clen);
+
+	char *rec = malloc(hlen + ilen + clen + 1);
+
+	memcpy(rec, header, hlen);
+	memcpy(&rec[hlen], item, ilen);
+	memcpy(&rec[hlen + ilen], cmd, clen);
+	rec[hlen + ilen + clen] = '\n';
+
+	if(write(gb->journal_fd, rec, hlen + ilen + clen + 1) < 0) {}
+
+	free(rec);
+}
+
+// Lets go of a journal inherited from a run in another directory,
+// leaving its file as it is
+void JournalDetach()
+{
+	if(gb->journal_fd >= 0)
+		close(gb->journal_fd);
+
+	gb->journal_fd   = -1;
+	gb->journal      = NULL;
+	gb->journal_item = NULL;
+}
+
+// A run that finished cleanly has nothing left to resume
+void JournalEnd(int status)
+{
+	if(gb->journal_fd >= 0)
+		close(gb->journal_fd);
+
+	gb->journal_fd = -1;
+
+	if(gb->journal != NULL)
+		HashMapDelete(gb->journal);
+
+	gb->journal = NULL;
+
+	if(status == 0)
+		unlink(VariantPath(JOURNAL_FILE));
+}
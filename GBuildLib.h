@@ -0,0 +1,34 @@
+#pragma once
+
+// Embedding API. Every GBuild is an isolated interpreter; separate
+// interpreters can be evaluated concurrently from different threads.
+// Threads share the process's working directory though, and the resume
+// journal and the #foreach_changed snapshot are files in it: builds that
+// run at the same time overwrite each other's, so they shouldn't use
+// --resume or #foreach_changed. memo() entries are shared by all of them.
+
+typedef struct GBuild GBuild;
+
+GBuild *GBuildNew();
+
+void GBuildDelete(GBuild *ctx);
+
+void GBuildSetDryRun(GBuild *ctx, int dry_run);
+
+// On by default: scripts are checked for errors before anything runs
+void GBuildSetCheck(GBuild *ctx, int check);
+
+// Skips the commands an interrupted earlier run already finished
+void GBuildSetResume(GBuild *ctx, int resume);
+
+// Each variant added runs the script once, concurrently with the others;
+// values set apply to the last variant added. Every variant gets the
+// variables 'variant' and 'outdir', which defaults to build/<name>
+void GBuildAddVariant(GBuild *ctx, const char *name);
+
+void GBuildSetVariantValue(GBuild *ctx, const char *key, const char *value);
+
+// Both return the script's exit status; errors in the script make it 1
+int GBuildEval(GBuild *ctx, const char *path, int argc, char **argv);
+
+int GBuildEvalSource(GBuild *ctx, const char *name, const char *source, int argc, char **argv);
@@ -0,0 +1,93 @@
+#include "GBuild.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+const char *ScriptName(int argc, char **argv)
+{
+	if(argc > 1) {
+		const char *arg = argv[argc-1];
+
+		if(strlen(arg) > 2) {
+			if(memcmp(arg, "f:", 2) == 0)
+				return &arg[2];
+		}
+	}
+
+	return "GBuildFile";
+}
+
+// Runs a script from a gbuild command line, in this process or in a server
+int CommandMain(GBuild *ctx, int argc, char **argv)
+{
+	int opts        = 0;
+	int print_stats = 0;
+	int variants    = 0;
+
+	while(opts + 1 < argc && strncmp(argv[opts + 1], "--", 2) == 0) {
+		char *opt = argv[++opts];
+
+		if(strcmp(opt, "--dry-run") == 0) {
+			GBuildSetDryRun(ctx, 1);
+		} else if(strcmp(opt, "--stats") == 0) {
+			print_stats = 1;
+		} else if(strcmp(opt, "--resume") == 0) {
+			GBuildSetResume(ctx, 1);
+		} else if(strcmp(opt, "--no-check") == 0) {
+			GBuildSetCheck(ctx, 0);
+		} else if(strcmp(opt, "--variant") == 0 && opts + 1 < argc) {
+			GBuildAddVariant(ctx, argv[++opts]);
+			variants++;
+		} else if(strcmp(opt, "--set") == 0 && opts + 1 < argc) {
+			char *value = strchr(argv[++opts], '=');
+
+			if(variants == 0 || value == NULL) {
+				printf("gbuild: fatal error: --set expects key=value after a --variant\n");
+				return 1;
+			}
+
+			*value = 0;
+			GBuildSetVariantValue(ctx, argv[opts], value + 1);
+			*value = '=';
+		} else {
+			printf("gbuild: fatal error: Unknown option '%s'\n", opt);
+			return 1;
+		}
+	}
+
+	// Options aren't visible to the script as arguments
+	argv[opts] = argv[0];
+	argv      += opts;
+	argc      -= opts;
+
+	int status = GBuildEval(ctx, ScriptName(argc, argv), argc, argv);
+
+	if(print_stats)
+		StatsPrint();
+
+	return status;
+}
+
+int main(int argc, char **argv)
+{
+	if(argc > 2 && strcmp(argv[1], "--worker") == 0)
+		return WorkerMain(argv[2]);
+
+	if(argc > 2 && strcmp(argv[1], "--server") == 0)
+		return ServerMain(argv[2]);
+
+	int status;
+
+	char *server = getenv("GBUILD_SERVER");
+
+	if(server != NULL && ClientMain(server, argc, argv, &status))
+		return status;
+
+	GBuild *ctx = GBuildNew();
+
+	status = CommandMain(ctx, argc, argv);
+
+	GBuildDelete(ctx);
+
+	return status;
+}
@@ -0,0 +1,214 @@
+#include "GBuild.h"
+#include <G64/G64.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <pthread.h>
+
+#define MEMO_FILE ".gbuild_memo"
+
+// The file only ever grows, so once it holds this many records and more
+// than twice as many as a run used, the end of the run rewrites it with
+// just the entries that run used
+#define MEMO_COMPACT_MIN 1024
+
+static HashMap *memos = NULL;
+
+static HashMap *memos_used = NULL;
+
+static uint64_t *used_keys = NULL;
+
+static size_t used_count = 0;
+
+static size_t used_cap = 0;
+
+static size_t memo_records = 0;
+
+static pthread_mutex_t memos_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void MemoUse(uint64_t key)
+{
+	if(HashFind(memos_used, (uint8_t*) &key, sizeof(key)) != NULL)
+		return;
+
+	if(used_count == used_cap)
+		used_keys = Grow(used_keys, &used_cap, sizeof(uint64_t));
+
+	used_keys[used_count++] = key;
+
+	HashPut(memos_used, (uint8_t*) &key, sizeof(key), (void*) 1);
+}
+
+static void MemoLoad()
+{
+	memos      = HashMapNew(1024, HashDefaultFunction);
+	memos_used = HashMapNew(1024, HashDefaultFunction);
+
+	File *f = FileRead(VariantPath(MEMO_FILE));
+
+	if(f->data == NULL || f->size == 0)
+		return;
+
+	char *data = (char*) f->data;
+	char *end  = data + f->size;
+
+	while(data < end) {
+		uint64_t key;
+		unsigned type;
+		size_t   len;
+
+		char header[128];
+		size_t hlen = 0;
+
+		while(data + hlen < end && data[hlen] != ';' && hlen < sizeof(header) - 1) {
+			header[hlen] = data[hlen];
+			hlen++;
+		}
+
+		header[hlen] = 0;
+
+		if(sscanf(header, "%lx %u %zu", &key, &type, &len) != 3 || data + hlen + 1 + len > end)
+			break;
+
+		data += hlen + 1;
+
+		Value *val = calloc(1, sizeof(Value));
+
+		char *text = malloc(len + 1);
+		memcpy(text, data, len);
+		text[len] = 0;
+
+		switch(type)
+		{
+		case VT_INT:    val->type = VT_INT;   val->cur_int   = strtoll(text, NULL, 10); free(text); break;
+		case VT_FLOAT:  val->type = VT_FLOAT; val->cur_float = strtod(text, NULL);      free(text); break;
+		case VT_STRING:
+			*val = ValueStringOwn(text, len);
+
+			if(len <= VALUE_INLINE_LEN)
+				free(text);
+			break;
+		}
+
+		HashPut(memos, (uint8_t*) &key, sizeof(key), val);
+
+		memo_records++;
+
+		data += len + 1;
+	}
+}
+
+Value *MemoFind(uint64_t key)
+{
+	pthread_mutex_lock(&memos_lock);
+
+	if(memos == NULL)
+		MemoLoad();
+
+	Value *val = HashFind(memos, (uint8_t*) &key, sizeof(key));
+
+	if(val != NULL)
+		MemoUse(key);
+
+	pthread_mutex_unlock(&memos_lock);
+
+	return val;
+}
+
+static void MemoWrite(FILE *f, uint64_t key, Value *val)
+{
+	char num[64];
+	char *text = num;
+	size_t len;
+
+	switch(val->type)
+	{
+	case VT_INT:   len = snprintf(num, sizeof(num), "%ld", val->cur_int);  break;
+	case VT_FLOAT: len = snprintf(num, sizeof(num), "%a", val->cur_float); break;
+	default:
+		text = ValueStr(val);
+		len  = val->str_len;
+		break;
+	}
+
+	fprintf(f, "%016lx %u %zu;", key, val->type, len);
+	fwrite(text, 1, len, f);
+	fputc('\n', f);
+}
+
+void MemoStore(uint64_t key, Value *val)
+{
+	pthread_mutex_lock(&memos_lock);
+
+	if(memos == NULL)
+		MemoLoad();
+
+	Value *copy = malloc(sizeof(Value));
+	*copy = *val;
+
+	HashPut(memos, (uint8_t*) &key, sizeof(key), copy);
+
+	MemoUse(key);
+
+	FILE *f = fopen(VariantPath(MEMO_FILE), "a");
+
+	if(f == NULL) {
+		pthread_mutex_unlock(&memos_lock);
+		return;
+	}
+
+	MemoWrite(f, key, val);
+
+	fclose(f);
+
+	memo_records++;
+
+	pthread_mutex_unlock(&memos_lock);
+}
+
+void MemoEnd(int status)
+{
+	pthread_mutex_lock(&memos_lock);
+
+	if(status != 0 || memos == NULL || memo_records < MEMO_COMPACT_MIN || memo_records <= 2 * used_count) {
+		pthread_mutex_unlock(&memos_lock);
+		return;
+	}
+
+	const char *path = VariantPath(MEMO_FILE);
+
+	char *tmp = malloc(strlen(path) + 5);
+	sprintf(tmp, "%s.tmp", path);
+
+	FILE *f = fopen(tmp, "w");
+
+	if(f != NULL) {
+		for(size_t i = 0; i < used_count; i++)
+			MemoWrite(f, used_keys[i], HashFind(memos, (uint8_t*) &used_keys[i], sizeof(uint64_t)));
+
+		if(fclose(f) == 0 && rename(tmp, VariantPath(MEMO_FILE)) == 0)
+			memo_records = used_count;
+		else
+			remove(tmp);
+	}
+
+	free(tmp);
+
+	pthread_mutex_unlock(&memos_lock);
+}
+
+// A forked child runs in another directory or variant, with a store of its
+// own; what the parent loaded is dropped and the child's is read on first
+// use. The lock may have been held by a thread that doesn't exist in the
+// child
+void MemoForget()
+{
+	pthread_mutex_init(&memos_lock, NULL);
+
+	memos        = NULL;
+	memos_used   = NULL;
+	used_keys    = NULL;
+	used_count   = 0;
+	used_cap     = 0;
+	memo_records = 0;
+}
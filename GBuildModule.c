@@ -0,0 +1,129 @@
+#include "GBuild.h"
+#include <G64/G64.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <sys/stat.h>
+
+Module *ModuleNew(const char *path, const char *source, size_t size)
+{
+	if(gb->modules == NULL)
+		gb->modules = HashMapNew(64, HashDefaultFunction);
+
+	Module *mod = calloc(1, sizeof(Module));
+
+	mod->path   = strdup(path);
+	mod->source = calloc(size + 1, 1);
+	memcpy(mod->source, source, size);
+
+	LexState *l = LexStateNew();
+
+	l->source  = mod->source;
+	l->skip_ws = 1;
+	l->buf     = calloc(size, 1);
+	l->error   = ErrorHandler;
+
+	mod->start  = l;
+	mod->braces = BraceTableNew();
+
+	// A lexical error unwinds from here, leaving the module to whoever
+	// catches it
+	gb->loading = mod;
+
+	BraceTableBuild(mod->braces, l);
+
+	gb->loading = NULL;
+
+	HashPut(gb->modules, (uint8_t*) mod->path, strlen(mod->path), mod);
+
+	return mod;
+}
+
+Module *ModuleLoad(const char *path)
+{
+	if(gb->modules != NULL) {
+		Module *mod = HashFind(gb->modules, (uint8_t*) path, strlen(path));
+		if(mod != NULL) return mod;
+	}
+
+	struct stat s;
+
+	if(stat(path, &s) != 0)
+		return NULL;
+
+	File *f = FileRead(path);
+
+	if(f->data == NULL || f->size == 0)
+		return NULL;
+
+	Module *mod = ModuleNew(path, (const char*) f->data, f->size);
+
+	mod->mtime_sec  = s.st_mtim.tv_sec;
+	mod->mtime_nsec = s.st_mtim.tv_nsec;
+
+	return mod;
+}
+
+void ModuleAlias(const char *path, Module *mod)
+{
+	char *key = strdup(path);
+
+	HashPut(gb->modules, (uint8_t*) key, strlen(key), mod);
+}
+
+static void ModuleFree(Module *mod)
+{
+	BraceTableFree(mod->braces);
+
+	free(mod->start->buf);
+	LexStateDelete(mod->start);
+
+	free(mod->source);
+	free(mod->path);
+	free(mod);
+}
+
+// Drops a module from the cache so the next load reads the file again, and
+// frees it. Only for modules nothing else points to, like the scripts the
+// server keeps between requests
+void ModuleForget(Module *mod)
+{
+	HashDelete(gb->modules, (uint8_t*) mod->path, strlen(mod->path));
+
+	ModuleFree(mod);
+}
+
+// Loads a module in a process that must outlive it: a lexical error is
+// reported and gives NULL instead of ending the process
+Module *ModuleLoadGuarded(const char *path)
+{
+	jmp_buf *outer = gb->exit_jmp;
+	jmp_buf  buf;
+
+	gb->exit_jmp = &buf;
+
+	if(setjmp(buf) != 0) {
+		gb->exit_jmp = outer;
+
+		if(gb->loading != NULL)
+			ModuleFree(gb->loading);
+
+		gb->loading = NULL;
+
+		return NULL;
+	}
+
+	Module *mod = ModuleLoad(path);
+
+	gb->exit_jmp = outer;
+
+	return mod;
+}
+
+void ModuleEnter(Module *mod)
+{
+	gb->module = mod;
+
+	lex = LexStateNew();
+	memcpy(lex, mod->start, sizeof(LexState));
+}
@@ -0,0 +1,1006 @@
+#define _GNU_SOURCE
+#include "GBuild.h"
+#include <G64/G64.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+extern char **environ;
+
+int WriteAll(int fd, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+
+	while(len > 0) {
+		ssize_t n = write(fd, p, len);
+
+		if(n < 0) {
+			if(errno == EINTR) continue;
+			return 0;
+		}
+
+		p   += n;
+		len -= n;
+	}
+
+	return 1;
+}
+
+int ReadAll(int fd, void *data, size_t len)
+{
+	uint8_t *p = data;
+
+	while(len > 0) {
+		ssize_t n = read(fd, p, len);
+
+		if(n < 0 && errno == EINTR) continue;
+		if(n <= 0) return 0;
+
+		p   += n;
+		len -= n;
+	}
+
+	return 1;
+}
+
+// Like WriteAll, but a peer that hung up is an error instead of a SIGPIPE
+static int SendAll(int fd, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+
+	while(len > 0) {
+		ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+
+		if(n < 0 && errno == ENOTSOCK)
+			return WriteAll(fd, p, len);
+
+		if(n < 0) {
+			if(errno == EINTR) continue;
+			return 0;
+		}
+
+		p   += n;
+		len -= n;
+	}
+
+	return 1;
+}
+
+int FrameSend(int fd, int type, const void *data, size_t len)
+{
+	uint8_t header[5];
+
+	uint32_t nlen = htonl(len);
+
+	header[0] = type;
+	memcpy(&header[1], &nlen, sizeof(nlen));
+
+	return SendAll(fd, header, sizeof(header)) && SendAll(fd, data, len);
+}
+
+// Returns the payload, NUL terminated, or NULL when the peer went away
+char *FrameRecv(int fd, int *type, size_t *len)
+{
+	uint8_t header[5];
+
+	if(!ReadAll(fd, header, sizeof(header)))
+		return NULL;
+
+	uint32_t nlen;
+	memcpy(&nlen, &header[1], sizeof(nlen));
+
+	*type = header[0];
+	*len  = ntohl(nlen);
+
+	char *data = malloc(*len + 1);
+
+	if(!ReadAll(fd, data, *len)) {
+		free(data);
+		return NULL;
+	}
+
+	data[*len] = 0;
+
+	return data;
+}
+
+static int SocketAddress(const char *addr, int listening)
+{
+	if(strncmp(addr, "unix:", 5) == 0) {
+		struct sockaddr_un un;
+		memset(&un, 0, sizeof(un));
+
+		un.sun_family = AF_UNIX;
+		strncpy(un.sun_path, &addr[5], sizeof(un.sun_path) - 1);
+
+		int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if(fd < 0) return -1;
+
+		if(listening) {
+			unlink(un.sun_path);
+
+			if(bind(fd, (struct sockaddr*) &un, sizeof(un)) != 0 || listen(fd, 64) != 0) {
+				close(fd);
+				return -1;
+			}
+		} else if(connect(fd, (struct sockaddr*) &un, sizeof(un)) != 0) {
+			close(fd);
+			return -1;
+		}
+
+		return fd;
+	}
+
+	char *host = strdup(addr);
+	char *port = strrchr(host, ':');
+
+	if(port == NULL) {
+		free(host);
+		return -1;
+	}
+
+	*port++ = 0;
+
+	struct addrinfo hints, *res;
+	memset(&hints, 0, sizeof(hints));
+
+	// Without a host this resolves to loopback; listening on every
+	// interface takes an explicit address like 0.0.0.0
+	hints.ai_family   = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	if(getaddrinfo(*host ? host : NULL, port, &hints, &res) != 0) {
+		free(host);
+		return -1;
+	}
+
+	int fd = -1;
+
+	for(struct addrinfo *ai = res; ai != NULL; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if(fd < 0) continue;
+
+		if(listening) {
+			int one = 1;
+			setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+			if(bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(fd, 64) == 0)
+				break;
+		} else if(connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+			break;
+		}
+
+		close(fd);
+		fd = -1;
+	}
+
+	freeaddrinfo(res);
+	free(host);
+
+	return fd;
+}
+
+int SocketConnect(const char *addr)
+{
+	return SocketAddress(addr, 0);
+}
+
+int SocketListen(const char *addr)
+{
+	return SocketAddress(addr, 1);
+}
+
+
+// Worker side
+
+// Files the worker writes or reads for a client stay inside the
+// directory the command runs in
+static int PathSafe(const char *path)
+{
+	if(path[0] == 0 || path[0] == '/')
+		return 0;
+
+	for(const char *p = path; *p != 0;) {
+		size_t len = strcspn(p, "/");
+
+		if(len == 2 && p[0] == '.' && p[1] == '.')
+			return 0;
+
+		p += len;
+
+		if(*p == '/') p++;
+	}
+
+	return 1;
+}
+
+static void WorkerRefuse(int fd, const char *path)
+{
+	char msg[4352];
+
+	int len = snprintf(msg, sizeof(msg), "gbuild: worker: Refusing path outside the work directory: %.4096s\n", path);
+
+	FrameSend(fd, FR_ERR, msg, len);
+}
+
+static void WorkerWriteInput(const char *path, const char *data, size_t len)
+{
+	char *dir   = strdup(path);
+	char *slash = strrchr(dir, '/');
+
+	if(slash != NULL) {
+		*slash = 0;
+		FSMkdir(dir);
+	}
+
+	free(dir);
+
+	FILE *f = fopen(path, "wb");
+	if(f == NULL) return;
+
+	fwrite(data, 1, len, f);
+	fclose(f);
+}
+
+int StreamRun(int fd, void (*run)(void *arg), void *arg)
+{
+	int out[2], err[2];
+
+	if(pipe(out) != 0 || pipe(err) != 0)
+		return 127;
+
+	pid_t pid = fork();
+
+	if(pid < 0) {
+		close(out[0]); close(out[1]);
+		close(err[0]); close(err[1]);
+		return 127;
+	}
+
+	if(pid == 0) {
+		dup2(out[1], STDOUT_FILENO);
+		dup2(err[1], STDERR_FILENO);
+
+		close(out[0]); close(out[1]);
+		close(err[0]); close(err[1]);
+		close(fd);
+
+		run(arg);
+		_exit(127);
+	}
+
+	close(out[1]);
+	close(err[1]);
+
+	struct pollfd pfd[2] = {
+		{ .fd = out[0], .events = POLLIN },
+		{ .fd = err[0], .events = POLLIN },
+	};
+
+	int open_fds = 2;
+
+	char buf[65536];
+
+	while(open_fds > 0) {
+		if(poll(pfd, 2, -1) < 0) {
+			if(errno == EINTR) continue;
+			break;
+		}
+
+		for(int i = 0; i < 2; i++) {
+			if(pfd[i].fd < 0 || pfd[i].revents == 0) continue;
+
+			ssize_t n = read(pfd[i].fd, buf, sizeof(buf));
+
+			if(n <= 0) {
+				close(pfd[i].fd);
+				pfd[i].fd = -1;
+				open_fds--;
+				continue;
+			}
+
+			FrameSend(fd, i == 0 ? FR_OUT : FR_ERR, buf, n);
+		}
+	}
+
+	int ws;
+
+	while(waitpid(pid, &ws, 0) < 0 && errno == EINTR);
+
+	return WIFEXITED(ws) ? WEXITSTATUS(ws) : 128 + WTERMSIG(ws);
+}
+
+typedef struct
+{
+	const char *cmd;
+	char      **envp;
+} ShellJob;
+
+static void RunShell(void *arg)
+{
+	ShellJob *job = arg;
+
+	char *argv[] = { "sh", "-c", (char*) job->cmd, NULL };
+
+	execve("/bin/sh", argv, job->envp ? job->envp : environ);
+}
+
+int StreamCommand(int fd, const char *cmd, char **envp)
+{
+	ShellJob job = { cmd, envp };
+
+	return StreamRun(fd, RunShell, &job);
+}
+
+static int TokenMatches(const char *token, const char *data, size_t len)
+{
+	size_t tlen = strlen(token);
+
+	if(len != tlen) return 0;
+
+	// Compared in full every time, so timing doesn't give the token away
+	unsigned char diff = 0;
+
+	for(size_t i = 0; i < len; i++)
+		diff |= token[i] ^ data[i];
+
+	return diff == 0;
+}
+
+static void WorkerSendOutput(int fd, const char *path)
+{
+	if(!PathSafe(path)) {
+		WorkerRefuse(fd, path);
+		return;
+	}
+
+	File *f = FileRead(path);
+
+	if(f->data == NULL) return;
+
+	size_t plen = strlen(path);
+
+	char *frame = malloc(plen + 1 + f->size);
+
+	memcpy(frame, path, plen + 1);
+	memcpy(&frame[plen + 1], f->data, f->size);
+
+	FrameSend(fd, FR_FILE, frame, plen + 1 + f->size);
+
+	free(frame);
+}
+
+static void WorkerServe(int fd, const char *token)
+{
+	// A worker with a token serves nothing until the client proves it
+	// knows it
+	if(token != NULL) {
+		int type;
+		size_t len;
+
+		char *data = FrameRecv(fd, &type, &len);
+
+		if(data == NULL || type != FR_AUTH || !TokenMatches(token, data, len))
+			_exit(1);
+
+		free(data);
+	}
+
+	for(;;) {
+		size_t env_count = 0, env_cap = 0;
+		size_t in_count  = 0, in_cap  = 0;
+		size_t out_count = 0, out_cap = 0;
+
+		char **envp    = NULL;
+		char **inputs  = NULL;
+		char **outputs = NULL;
+		char  *cmd     = NULL;
+
+		while(cmd == NULL) {
+			int type;
+			size_t len;
+
+			char *data = FrameRecv(fd, &type, &len);
+
+			if(data == NULL)
+				_exit(0);
+
+			switch(type)
+			{
+			case FR_CWD:
+				if(chdir(data) != 0) {
+					FSMkdir(data);
+					if(chdir(data) != 0) {}
+				}
+				free(data);
+				break;
+			case FR_ENV:
+				if(env_count + 1 >= env_cap)
+					envp = Grow(envp, &env_cap, sizeof(char*));
+				envp[env_count++] = data;
+				break;
+			case FR_INPUT:
+				// A content hash followed by a path
+				if(len <= sizeof(uint64_t)) {
+					free(data);
+					break;
+				}
+				if(in_count == in_cap)
+					inputs = Grow(inputs, &in_cap, sizeof(char*));
+				inputs[in_count++] = data;
+				break;
+			case FR_WANT:
+				if(out_count == out_cap)
+					outputs = Grow(outputs, &out_cap, sizeof(char*));
+				outputs[out_count++] = data;
+				break;
+			case FR_CMD:
+				cmd = data;
+				break;
+			default:
+				free(data);
+				break;
+			}
+		}
+
+		if(envp != NULL)
+			envp[env_count] = NULL;
+
+		// Inputs are announced by content hash; only the ones this worker
+		// doesn't already see get shipped
+		size_t needed = 0;
+
+		char **need = malloc((in_count + 1) * sizeof(char*));
+
+		for(size_t i = 0; i < in_count; i++) {
+			uint64_t want, have;
+
+			memcpy(&want, inputs[i], sizeof(want));
+
+			char *path = &inputs[i][sizeof(want)];
+
+			if(!PathSafe(path)) {
+				WorkerRefuse(fd, path);
+				continue;
+			}
+
+			if(!FileHash(path, &have) || have != want) {
+				FrameSend(fd, FR_NEED, path, strlen(path));
+				need[needed++] = path;
+			}
+		}
+
+		FrameSend(fd, FR_NEED, "", 0);
+
+		for(size_t i = 0; i < needed; i++) {
+			int type;
+			size_t len;
+
+			char *data = FrameRecv(fd, &type, &len);
+
+			if(data == NULL)
+				_exit(0);
+
+			size_t plen = strlen(data);
+
+			// Only files this worker asked for are written
+			int asked = 0;
+
+			for(size_t j = 0; j < needed && !asked; j++)
+				asked = strcmp(need[j], data) == 0;
+
+			if(type == FR_DATA && plen < len && asked)
+				WorkerWriteInput(data, &data[plen + 1], len - plen - 1);
+
+			free(data);
+		}
+
+		free(need);
+
+		int32_t status = htonl(StreamCommand(fd, cmd, envp));
+
+		// Declared outputs go back before the status, so the client has
+		// them by the time it counts the command as done
+		for(size_t i = 0; i < out_count; i++)
+			WorkerSendOutput(fd, outputs[i]);
+
+		FrameSend(fd, FR_EXIT, &status, sizeof(status));
+
+		for(size_t i = 0; i < env_count; i++)
+			free(envp[i]);
+
+		for(size_t i = 0; i < in_count; i++)
+			free(inputs[i]);
+
+		for(size_t i = 0; i < out_count; i++)
+			free(outputs[i]);
+
+		free(envp);
+		free(inputs);
+		free(outputs);
+		free(cmd);
+	}
+}
+
+int WorkerMain(const char *addr)
+{
+	char *token = getenv("GBUILD_WORKER_TOKEN");
+
+	if(token != NULL && *token == 0)
+		token = NULL;
+
+	// Anyone who reaches a TCP port could run commands, a unix socket is
+	// at least guarded by its file permissions
+	if(token == NULL && strncmp(addr, "unix:", 5) != 0) {
+		printf("gbuild: fatal error: A TCP worker needs GBUILD_WORKER_TOKEN\n");
+		return 1;
+	}
+
+	int sock = SocketListen(addr);
+
+	if(sock < 0) {
+		printf("gbuild: fatal error: Can't listen on %s\n", addr);
+		return 1;
+	}
+
+	signal(SIGCHLD, SIG_IGN);
+
+	printf("gbuild: worker listening on %s\n", addr);
+	fflush(stdout);
+
+	for(;;) {
+		int fd = accept(sock, NULL, NULL);
+
+		if(fd < 0) {
+			if(errno == EINTR) continue;
+			return 1;
+		}
+
+		if(fork() == 0) {
+			close(sock);
+			signal(SIGCHLD, SIG_DFL);
+			WorkerServe(fd, token);
+		}
+
+		close(fd);
+	}
+}
+
+
+// Client side
+
+typedef struct
+{
+	int     fd;
+	int     busy;
+	char   *addr;
+
+	// What the running command declared it writes; the worker may only
+	// send back these
+	char  **outputs;
+	size_t  output_count;
+} Slot;
+
+static Slot *slots = NULL;
+
+static size_t slot_count = 0;
+
+static int slots_ready = 0;
+
+static int64_t remote_failed = 0;
+
+// The process that connected the slots; only it may read their replies
+static pid_t slots_owner = 0;
+
+// Workers are shared by every interpreter in the process
+static pthread_mutex_t slots_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void RemoteSetup()
+{
+	static int drain_at_exit = 0;
+
+	slots_ready = 1;
+	slots_owner = getpid();
+
+	char *workers = getenv("GBUILD_WORKERS");
+	if(workers == NULL) return;
+
+	char *token = getenv("GBUILD_WORKER_TOKEN");
+
+	size_t cap = 0;
+
+	char *list = strdup(workers);
+	char *save = NULL;
+
+	for(char *addr = strtok_r(list, ",", &save); addr != NULL; addr = strtok_r(NULL, ",", &save)) {
+		long  copies = 1;
+		char *star   = strrchr(addr, '*');
+
+		if(star != NULL) {
+			*star  = 0;
+			copies = strtol(star + 1, NULL, 10);
+		}
+
+		for(long i = 0; i < copies; i++) {
+			int fd = SocketConnect(addr);
+
+			if(fd >= 0 && token != NULL && *token != 0 && !FrameSend(fd, FR_AUTH, token, strlen(token))) {
+				close(fd);
+				fd = -1;
+			}
+
+			if(fd < 0) {
+				printf("gbuild: warning: Can't connect to worker %s\n", addr);
+				break;
+			}
+
+			if(slot_count == cap)
+				slots = Grow(slots, &cap, sizeof(Slot));
+
+			slots[slot_count++] = (Slot) { fd, 0, strdup(addr), NULL, 0 };
+		}
+	}
+
+	free(list);
+
+	if(!drain_at_exit)
+		atexit(RemoteDrain);
+
+	drain_at_exit = 1;
+}
+
+static void SlotOutputsFree(Slot *slot)
+{
+	for(size_t i = 0; i < slot->output_count; i++)
+		free(slot->outputs[i]);
+
+	free(slot->outputs);
+
+	slot->outputs      = NULL;
+	slot->output_count = 0;
+}
+
+static void RemoteFail(Slot *slot)
+{
+	printf("gbuild: error: Lost connection to worker %s\n", slot->addr);
+
+	close(slot->fd);
+
+	slot->fd   = -1;
+	slot->busy = 0;
+
+	SlotOutputsFree(slot);
+
+	remote_failed++;
+}
+
+static void RemoteWriteOutput(Slot *slot, const char *data, size_t len)
+{
+	size_t plen = strnlen(data, len);
+
+	if(plen == len) return;
+
+	int declared = 0;
+
+	for(size_t i = 0; i < slot->output_count && !declared; i++)
+		declared = strcmp(slot->outputs[i], data) == 0;
+
+	if(!declared) {
+		printf("gbuild: error: Worker %s sent undeclared file %s\n", slot->addr, data);
+		return;
+	}
+
+	char *dir   = strdup(data);
+	char *slash = strrchr(dir, '/');
+
+	if(slash != NULL) {
+		*slash = 0;
+		FSMkdir(dir);
+	}
+
+	free(dir);
+
+	FILE *f = fopen(data, "wb");
+
+	if(f == NULL) {
+		printf("gbuild: error: Can't write %s\n", data);
+		return;
+	}
+
+	fwrite(&data[plen + 1], 1, len - plen - 1, f);
+	fclose(f);
+}
+
+static void RemoteHandle(Slot *slot)
+{
+	int type;
+	size_t len;
+
+	char *data = FrameRecv(slot->fd, &type, &len);
+
+	if(data == NULL) {
+		RemoteFail(slot);
+		return;
+	}
+
+	switch(type)
+	{
+	case FR_OUT:
+		WriteAll(STDOUT_FILENO, data, len);
+		break;
+	case FR_ERR:
+		WriteAll(STDERR_FILENO, data, len);
+		break;
+	case FR_FILE:
+		RemoteWriteOutput(slot, data, len);
+		break;
+	case FR_EXIT: {
+		if(len != sizeof(int32_t)) {
+			free(data);
+			RemoteFail(slot);
+			return;
+		}
+
+		int32_t status;
+		memcpy(&status, data, sizeof(status));
+
+		if(ntohl(status) != 0)
+			remote_failed++;
+
+		slot->busy = 0;
+
+		SlotOutputsFree(slot);
+		break;
+	  }
+	}
+
+	free(data);
+}
+
+// The worker asks for the inputs it lacks right after it gets the command;
+// they're sent at once so the worker never waits on the next pump
+static int RemoteServeInputs(Slot *slot, char **inputs, size_t input_count)
+{
+	for(;;) {
+		int type;
+		size_t len;
+
+		char *data = FrameRecv(slot->fd, &type, &len);
+
+		if(data == NULL) return 0;
+
+		if(type != FR_NEED) {
+			if(type == FR_ERR)
+				WriteAll(STDERR_FILENO, data, len);
+
+			free(data);
+			continue;
+		}
+
+		if(len == 0) {
+			free(data);
+			return 1;
+		}
+
+		// A worker only gets the files this command declared
+		int declared = 0;
+
+		for(size_t i = 0; i < input_count && !declared; i++)
+			declared = strcmp(inputs[i], data) == 0;
+
+		File *f = declared ? FileRead(data) : NULL;
+
+		size_t size = f == NULL || f->data == NULL ? 0 : f->size;
+
+		char *frame = malloc(len + 1 + size);
+
+		memcpy(frame, data, len + 1);
+		if(size > 0)
+			memcpy(&frame[len + 1], f->data, size);
+
+		int ok = FrameSend(slot->fd, FR_DATA, frame, len + 1 + size);
+
+		free(frame);
+		free(data);
+
+		if(!ok) return 0;
+	}
+}
+
+// Handles worker traffic until at least one slot is free, or until every
+// slot is idle when drain is set
+static void RemotePump(int drain)
+{
+	struct pollfd *pfd = malloc(slot_count * sizeof(struct pollfd));
+
+	for(;;) {
+		size_t busy = 0, idle = 0;
+
+		for(size_t i = 0; i < slot_count; i++) {
+			if(slots[i].busy)
+				busy++;
+			else if(slots[i].fd >= 0)
+				idle++;
+
+			pfd[i] = (struct pollfd) { .fd = slots[i].busy ? slots[i].fd : -1, .events = POLLIN };
+		}
+
+		if(busy == 0 || (!drain && idle > 0))
+			break;
+
+		fflush(stdout);
+
+		if(poll(pfd, slot_count, -1) < 0) {
+			if(errno == EINTR) continue;
+			break;
+		}
+
+		for(size_t i = 0; i < slot_count; i++) {
+			if(pfd[i].fd >= 0 && pfd[i].revents != 0)
+				RemoteHandle(&slots[i]);
+		}
+	}
+
+	free(pfd);
+}
+
+void RemoteDrain()
+{
+	if(slots_owner != getpid())
+		return;
+
+	pthread_mutex_lock(&slots_lock);
+
+	if(slot_count > 0)
+		RemotePump(1);
+
+	pthread_mutex_unlock(&slots_lock);
+}
+
+// A forked child has copies of the parent's worker connections, some
+// with the parent's commands still running. The replies are the parent's
+// to read, so the child lets go of its copies and connects again if it
+// runs remote commands itself. The lock may have been held by a thread
+// that doesn't exist in the child
+void RemoteForget()
+{
+	pthread_mutex_init(&slots_lock, NULL);
+
+	for(size_t i = 0; i < slot_count; i++) {
+		if(slots[i].fd >= 0)
+			close(slots[i].fd);
+
+		free(slots[i].addr);
+		SlotOutputsFree(&slots[i]);
+	}
+
+	free(slots);
+
+	slots         = NULL;
+	slot_count    = 0;
+	slots_ready   = 0;
+	slots_owner   = 0;
+	remote_failed = 0;
+}
+
+int64_t RemoteWait()
+{
+	pthread_mutex_lock(&slots_lock);
+
+	if(slot_count > 0)
+		RemotePump(1);
+
+	int64_t failed = remote_failed;
+	remote_failed  = 0;
+
+	pthread_mutex_unlock(&slots_lock);
+
+	return failed;
+}
+
+static void RemoteSubmit(const char *cmd, char **inputs, size_t input_count, char **outputs, size_t output_count)
+{
+	if(!slots_ready)
+		RemoteSetup();
+
+	printf("%s\n", cmd);
+
+	Slot *slot = NULL;
+
+	while(slot == NULL) {
+		size_t alive = 0;
+
+		for(size_t i = 0; i < slot_count; i++) {
+			if(slots[i].fd < 0) continue;
+
+			alive++;
+
+			if(!slots[i].busy) {
+				slot = &slots[i];
+				break;
+			}
+		}
+
+		if(alive == 0) break;
+
+		if(slot == NULL)
+			RemotePump(0);
+	}
+
+	// Without workers the command runs here, with the same accounting
+	if(slot == NULL) {
+		fflush(stdout);
+
+		if(RunCommand(cmd) != 0)
+			remote_failed++;
+
+		return;
+	}
+
+	char cwd[4096];
+
+	if(getcwd(cwd, sizeof(cwd)) == NULL)
+		cwd[0] = 0;
+
+	int ok = FrameSend(slot->fd, FR_CWD, cwd, strlen(cwd));
+
+	for(char **env = environ; ok && *env != NULL; env++)
+		ok = FrameSend(slot->fd, FR_ENV, *env, strlen(*env));
+
+	for(size_t i = 0; ok && i < input_count; i++) {
+		uint64_t hash = 0;
+
+		if(!FileHash(inputs[i], &hash))
+			continue;
+
+		size_t len = strlen(inputs[i]);
+
+		char *frame = malloc(sizeof(hash) + len);
+
+		memcpy(frame, &hash, sizeof(hash));
+		memcpy(&frame[sizeof(hash)], inputs[i], len);
+
+		ok = FrameSend(slot->fd, FR_INPUT, frame, sizeof(hash) + len);
+
+		free(frame);
+	}
+
+	for(size_t i = 0; ok && i < output_count; i++)
+		ok = FrameSend(slot->fd, FR_WANT, outputs[i], strlen(outputs[i]));
+
+	if(ok)
+		ok = FrameSend(slot->fd, FR_CMD, cmd, strlen(cmd));
+
+	if(ok)
+		ok = RemoteServeInputs(slot, inputs, input_count);
+
+	if(!ok) {
+		RemoteFail(slot);
+		return;
+	}
+
+	slot->outputs      = malloc(output_count * sizeof(char*) + 1);
+	slot->output_count = output_count;
+
+	for(size_t i = 0; i < output_count; i++)
+		slot->outputs[i] = strdup(outputs[i]);
+
+	slot->busy = 1;
+}
+
+void RemoteRun(const char *cmd, char **inputs, size_t input_count, char **outputs, size_t output_count)
+{
+	pthread_mutex_lock(&slots_lock);
+	RemoteSubmit(cmd, inputs, input_count, outputs, output_count);
+	pthread_mutex_unlock(&slots_lock);
+}
@@ -0,0 +1,267 @@
+#define _GNU_SOURCE
+#include "GBuild.h"
+#include <G64/G64.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+extern char **environ;
+
+typedef struct
+{
+	char    *cwd;
+	char   **envp;
+	size_t   env_count;
+	size_t   env_cap;
+	char   **argv;
+	size_t   arg_count;
+	size_t   arg_cap;
+	GBuild  *ctx;
+	Module  *mod;
+} Request;
+
+static void RequestFree(Request *req)
+{
+	for(size_t i = 0; i < req->env_count; i++)
+		free(req->envp[i]);
+
+	for(size_t i = 0; i < req->arg_count; i++)
+		free(req->argv[i]);
+
+	free(req->envp);
+	free(req->argv);
+	free(req->cwd);
+}
+
+static char **RequestAdd(char **list, size_t *count, size_t *cap, char *item)
+{
+	if(*count + 1 >= *cap)
+		list = Grow(list, cap, sizeof(char*));
+
+	list[(*count)++] = item;
+	list[*count]     = NULL;
+
+	return list;
+}
+
+static int RequestRead(int fd, Request *req)
+{
+	memset(req, 0, sizeof(Request));
+
+	for(;;) {
+		int type;
+		size_t len;
+
+		char *data = FrameRecv(fd, &type, &len);
+
+		if(data == NULL)
+			return 0;
+
+		switch(type)
+		{
+		case FR_CWD:
+			free(req->cwd);
+			req->cwd = data;
+			break;
+		case FR_ENV:
+			req->envp = RequestAdd(req->envp, &req->env_count, &req->env_cap, data);
+			break;
+		case FR_ARG:
+			req->argv = RequestAdd(req->argv, &req->arg_count, &req->arg_cap, data);
+			break;
+		case FR_RUN:
+			free(data);
+			return req->cwd != NULL && req->arg_count > 0;
+		default:
+			free(data);
+			break;
+		}
+	}
+}
+
+// Finds the request's script in the server's cache, reloading it when the
+// file changed since it was parsed
+static Module *RequestModule(Request *req)
+{
+	const char *name = ScriptName(req->arg_count, req->argv);
+
+	char *path = name[0] == '/' ? strdup(name) : PathJoin(req->cwd, name);
+
+	gb = req->ctx;
+
+	// A script that doesn't lex isn't cached; the request parses it again
+	// and reports the error to its client
+	Module *mod = ModuleLoadGuarded(path);
+
+	struct stat s;
+
+	if(mod != NULL && stat(path, &s) == 0 &&
+	   (mod->mtime_sec != s.st_mtim.tv_sec || mod->mtime_nsec != s.st_mtim.tv_nsec)) {
+		ModuleForget(mod);
+		mod = ModuleLoadGuarded(path);
+	}
+
+	gb = NULL;
+
+	free(path);
+
+	return mod;
+}
+
+static void RequestEval(void *arg)
+{
+	Request *req = arg;
+
+	setvbuf(stdout, NULL, _IOLBF, 0);
+
+	if(chdir(req->cwd) != 0) {
+		printf("gbuild: fatal error: Can't enter %s\n", req->cwd);
+		exit(1);
+	}
+
+	if(req->envp != NULL)
+		environ = req->envp;
+
+	if(req->mod != NULL) {
+		gb = req->ctx;
+		ModuleAlias(ScriptName(req->arg_count, req->argv), req->mod);
+		gb = NULL;
+	}
+
+	exit(CommandMain(req->ctx, req->arg_count, req->argv));
+}
+
+int ServerMain(const char *path)
+{
+	char *addr = malloc(strlen(path) + 6);
+
+	sprintf(addr, "unix:%s", path);
+
+	int sock = SocketListen(addr);
+
+	free(addr);
+
+	if(sock < 0) {
+		printf("gbuild: fatal error: Can't listen on %s\n", path);
+		return 1;
+	}
+
+	signal(SIGCHLD, SIG_IGN);
+
+	printf("gbuild: server listening on %s\n", path);
+	fflush(stdout);
+
+	// Parsed scripts stay here between requests; every request runs in a
+	// fork of this context
+	GBuild *ctx = GBuildNew();
+
+	for(;;) {
+		int fd = accept(sock, NULL, NULL);
+
+		if(fd < 0) {
+			if(errno == EINTR) continue;
+			return 1;
+		}
+
+		Request req;
+
+		if(RequestRead(fd, &req)) {
+			req.ctx = ctx;
+			req.mod = RequestModule(&req);
+
+			// What the server printed, like a script that failed to parse,
+			// stays in its own log rather than in the request's output
+			fflush(stdout);
+
+			if(fork() == 0) {
+				close(sock);
+				signal(SIGCHLD, SIG_DFL);
+
+				int32_t status = htonl(StreamRun(fd, RequestEval, &req));
+
+				FrameSend(fd, FR_EXIT, &status, sizeof(status));
+				_exit(0);
+			}
+		}
+
+		RequestFree(&req);
+		close(fd);
+	}
+}
+
+// Hands the command line to a running server, returns 0 if there is none
+int ClientMain(const char *path, int argc, char **argv, int *status)
+{
+	char *addr = malloc(strlen(path) + 6);
+
+	sprintf(addr, "unix:%s", path);
+
+	int fd = SocketConnect(addr);
+
+	free(addr);
+
+	if(fd < 0) return 0;
+
+	char cwd[4096];
+
+	if(getcwd(cwd, sizeof(cwd)) == NULL) {
+		close(fd);
+		return 0;
+	}
+
+	int ok = FrameSend(fd, FR_CWD, cwd, strlen(cwd));
+
+	for(char **env = environ; ok && *env != NULL; env++)
+		ok = FrameSend(fd, FR_ENV, *env, strlen(*env));
+
+	for(int i = 0; ok && i < argc; i++)
+		ok = FrameSend(fd, FR_ARG, argv[i], strlen(argv[i]));
+
+	if(ok)
+		ok = FrameSend(fd, FR_RUN, "", 0);
+
+	if(!ok) {
+		close(fd);
+		return 0;
+	}
+
+	*status = 1;
+
+	for(;;) {
+		int type;
+		size_t len;
+
+		char *data = FrameRecv(fd, &type, &len);
+
+		if(data == NULL) {
+			printf("gbuild: error: Lost connection to server %s\n", path);
+			break;
+		}
+
+		if(type == FR_OUT)
+			WriteAll(STDOUT_FILENO, data, len);
+		else if(type == FR_ERR)
+			WriteAll(STDERR_FILENO, data, len);
+
+		if(type == FR_EXIT && len == sizeof(int32_t)) {
+			int32_t net;
+			memcpy(&net, data, sizeof(net));
+
+			*status = ntohl(net);
+		}
+
+		free(data);
+
+		if(type == FR_EXIT) break;
+	}
+
+	close(fd);
+
+	return 1;
+}
@@ -0,0 +1,269 @@
+#include "GBuild.h"
+#include <G64/G64.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+
+#define SNAPSHOT_FILE ".gbuild_snapshot"
+
+// Records are "ino size mtime path_len;" + path + "\n", one per file
+// the last successful run scanned
+
+typedef struct
+{
+	char    *path;
+	FileStat st;
+} SnapEntry;
+
+struct Snapshot
+{
+	// Entries of the last successful run
+	SnapEntry *old;
+	size_t     old_count;
+	size_t     old_cap;
+	HashMap   *old_map;
+
+	// Entries of this run; cur_map holds an index + 1 into cur
+	SnapEntry *cur;
+	size_t     cur_count;
+	size_t     cur_cap;
+	HashMap   *cur_map;
+
+	// Extensions scanned in this run; their old entries are replaced
+	HashMap   *exts;
+	int        scanned;
+};
+
+static const char *PathExt(const char *path)
+{
+	const char *slash = strrchr(path, '/');
+	const char *dot   = strchr(slash ? slash + 1 : path, '.');
+
+	return dot ? dot + 1 : "";
+}
+
+static void SnapshotLoad(Snapshot *snap)
+{
+	File *f = FileRead(VariantPath(SNAPSHOT_FILE));
+
+	if(f->data == NULL || f->size == 0)
+		return;
+
+	char *data = (char*) f->data;
+	char *end  = data + f->size;
+
+	while(data < end) {
+		FileStat st;
+		size_t   len;
+
+		char header[128];
+		size_t hlen = 0;
+
+		while(data + hlen < end && data[hlen] != ';' && hlen < sizeof(header) - 1) {
+			header[hlen] = data[hlen];
+			hlen++;
+		}
+
+		header[hlen] = 0;
+
+		if(sscanf(header, "%lu %ld %ld %zu", &st.ino, &st.size, &st.mtime, &len) != 4 || data + hlen + 1 + len > end)
+			break;
+
+		data += hlen + 1;
+
+		if(snap->old_count == snap->old_cap)
+			snap->old = Grow(snap->old, &snap->old_cap, sizeof(SnapEntry));
+
+		snap->old[snap->old_count++] = (SnapEntry) { strndup(data, len), st };
+
+		data += len + 1;
+	}
+
+	// The map points into old, so it's built once old stops growing
+	for(size_t i = 0; i < snap->old_count; i++) {
+		char *path = snap->old[i].path;
+
+		HashPut(snap->old_map, (uint8_t*) path, strlen(path), &snap->old[i]);
+	}
+}
+
+void SnapshotBegin()
+{
+	Snapshot *snap = calloc(1, sizeof(Snapshot));
+
+	snap->old_map = HashMapNew(1024, HashDefaultFunction);
+	snap->cur_map = HashMapNew(1024, HashDefaultFunction);
+	snap->exts    = HashMapNew(16, HashDefaultFunction);
+
+	SnapshotLoad(snap);
+
+	gb->snapshot = snap;
+}
+
+static void SnapshotScan(const char *ext, char **paths, size_t count, FileStat *st)
+{
+	Snapshot *snap = gb->snapshot;
+
+	StatFiles(paths, count, st);
+
+	HashPut(snap->exts, (uint8_t*) ext, strlen(ext), (void*) ext);
+
+	snap->scanned = 1;
+
+	for(size_t i = 0; i < count; i++) {
+		if(st[i].mtime < 0) continue;
+
+		size_t plen = strlen(paths[i]);
+		size_t idx  = (uintptr_t) HashFind(snap->cur_map, (uint8_t*) paths[i], plen);
+
+		if(idx != 0) {
+			snap->cur[idx - 1].st = st[i];
+			continue;
+		}
+
+		if(snap->cur_count == snap->cur_cap)
+			snap->cur = Grow(snap->cur, &snap->cur_cap, sizeof(SnapEntry));
+
+		char *path = strdup(paths[i]);
+
+		snap->cur[snap->cur_count++] = (SnapEntry) { path, st[i] };
+
+		HashPut(snap->cur_map, (uint8_t*) path, plen, (void*) (uintptr_t) snap->cur_count);
+	}
+}
+
+void SnapshotChanged(const char *ext, char **paths, size_t count, int *changed)
+{
+	Snapshot *snap = gb->snapshot;
+
+	FileStat *st = malloc(count * sizeof(FileStat));
+
+	SnapshotScan(ext, paths, count, st);
+
+	for(size_t i = 0; i < count; i++) {
+		SnapEntry *e = HashFind(snap->old_map, (uint8_t*) paths[i], strlen(paths[i]));
+
+		// A replaced file shows up as a new inode even with the same mtime
+		changed[i] = st[i].mtime >= 0 && (e == NULL || e->st.ino != st[i].ino || e->st.size != st[i].size || e->st.mtime != st[i].mtime);
+	}
+
+	free(st);
+}
+
+char **SnapshotRemoved(const char *ext, char **paths, size_t count, size_t *removed)
+{
+	Snapshot *snap = gb->snapshot;
+
+	FileStat *st = malloc(count * sizeof(FileStat));
+
+	SnapshotScan(ext, paths, count, st);
+
+	free(st);
+
+	HashMap *present = HashMapNew(count + 16, HashDefaultFunction);
+
+	for(size_t i = 0; i < count; i++)
+		HashPut(present, (uint8_t*) paths[i], strlen(paths[i]), paths[i]);
+
+	size_t cap = 0;
+
+	char **gone = NULL;
+
+	*removed = 0;
+
+	for(size_t i = 0; i < snap->old_count; i++) {
+		char *path = snap->old[i].path;
+
+		if(strcmp(PathExt(path), ext) != 0 || HashFind(present, (uint8_t*) path, strlen(path)) != NULL)
+			continue;
+
+		if(*removed == cap)
+			gone = Grow(gone, &cap, sizeof(char*));
+
+		gone[(*removed)++] = path;
+	}
+
+	HashMapDelete(present);
+
+	return gone;
+}
+
+void SnapshotForget(const char *path)
+{
+	Snapshot *snap = gb->snapshot;
+
+	size_t idx = (uintptr_t) HashFind(snap->cur_map, (uint8_t*) path, strlen(path));
+
+	if(idx != 0)
+		snap->cur[idx - 1].st.mtime = -1;
+}
+
+static void SnapshotWrite(FILE *f, SnapEntry *e)
+{
+	if(e->st.mtime < 0) return;
+
+	fprintf(f, "%lu %ld %ld %zu;%s\n", e->st.ino, e->st.size, e->st.mtime, strlen(e->path), e->path);
+}
+
+static void SnapshotSave(Snapshot *snap)
+{
+	const char *path = VariantPath(SNAPSHOT_FILE);
+
+	char *tmp = malloc(strlen(path) + 5);
+	sprintf(tmp, "%s.tmp", path);
+
+	FILE *f = fopen(tmp, "w");
+
+	if(f == NULL) {
+		free(tmp);
+		return;
+	}
+
+	// Files of extensions this run didn't scan keep their old entries
+	for(size_t i = 0; i < snap->old_count; i++) {
+		const char *ext = PathExt(snap->old[i].path);
+
+		if(HashFind(snap->exts, (uint8_t*) ext, strlen(ext)) == NULL)
+			SnapshotWrite(f, &snap->old[i]);
+	}
+
+	for(size_t i = 0; i < snap->cur_count; i++)
+		SnapshotWrite(f, &snap->cur[i]);
+
+	// Written aside and renamed so a killed run can't leave half a snapshot
+	if(fclose(f) == 0)
+		rename(tmp, VariantPath(SNAPSHOT_FILE));
+	else
+		remove(tmp);
+
+	free(tmp);
+}
+
+void SnapshotEnd(int status)
+{
+	Snapshot *snap = gb->snapshot;
+
+	if(snap == NULL) return;
+
+	// A run that scanned nothing leaves the last snapshot as it is
+	if(status == 0 && !gb->dry_run && snap->scanned)
+		SnapshotSave(snap);
+
+	for(size_t i = 0; i < snap->old_count; i++)
+		free(snap->old[i].path);
+
+	for(size_t i = 0; i < snap->cur_count; i++)
+		free(snap->cur[i].path);
+
+	free(snap->old);
+	free(snap->cur);
+
+	HashMapDelete(snap->old_map);
+	HashMapDelete(snap->cur_map);
+	HashMapDelete(snap->exts);
+
+	free(snap);
+
+	gb->snapshot = NULL;
+}
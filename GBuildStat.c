@@ -0,0 +1,279 @@
+#define _GNU_SOURCE
+#include "GBuild.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#define STAT_RING_SIZE 256
+
+// Below this many paths starting threads costs more than it saves
+#define STAT_THREAD_MIN 64
+
+static FileStat StatxInfo(struct statx *stx)
+{
+	return (FileStat) {
+		.mtime = stx->stx_mtime.tv_sec * 1000000000LL + stx->stx_mtime.tv_nsec,
+		.size  = stx->stx_size,
+		.ino   = stx->stx_ino
+	};
+}
+
+static FileStat StatOne(const char *path)
+{
+	struct stat s;
+
+	if(stat(path, &s) != 0)
+		return (FileStat) { .mtime = -1 };
+
+	return (FileStat) {
+		.mtime = s.st_mtim.tv_sec * 1000000000LL + s.st_mtim.tv_nsec,
+		.size  = s.st_size,
+		.ino   = s.st_ino
+	};
+}
+
+typedef struct
+{
+	int                  fd;
+	uint8_t             *sq_ring;
+	uint8_t             *cq_ring;
+	size_t               sq_size;
+	size_t               cq_size;
+	struct io_uring_sqe *sqes;
+	size_t               sqes_size;
+	struct io_uring_params p;
+} Ring;
+
+static int RingOpen(Ring *r)
+{
+	memset(r, 0, sizeof(Ring));
+
+	r->fd = syscall(__NR_io_uring_setup, STAT_RING_SIZE, &r->p);
+	if(r->fd < 0) return 0;
+
+	r->sq_size   = r->p.sq_off.array + r->p.sq_entries * sizeof(uint32_t);
+	r->cq_size   = r->p.cq_off.cqes + r->p.cq_entries * sizeof(struct io_uring_cqe);
+	r->sqes_size = r->p.sq_entries * sizeof(struct io_uring_sqe);
+
+	r->sq_ring = mmap(NULL, r->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	r->cq_ring = mmap(NULL, r->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+	r->sqes    = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+
+	if(r->sq_ring == MAP_FAILED || r->cq_ring == MAP_FAILED || r->sqes == MAP_FAILED) {
+		if(r->sq_ring != MAP_FAILED) munmap(r->sq_ring, r->sq_size);
+		if(r->cq_ring != MAP_FAILED) munmap(r->cq_ring, r->cq_size);
+		if(r->sqes != MAP_FAILED)    munmap(r->sqes, r->sqes_size);
+
+		close(r->fd);
+		return 0;
+	}
+
+	return 1;
+}
+
+static void RingClose(Ring *r)
+{
+	munmap(r->sq_ring, r->sq_size);
+	munmap(r->cq_ring, r->cq_size);
+	munmap(r->sqes, r->sqes_size);
+
+	close(r->fd);
+}
+
+// Waits out requests the kernel took but hasn't completed, discarding
+// their results. Fails when it can't wait for them
+static int RingDrain(Ring *r, uint32_t pending)
+{
+	uint32_t *cq_head = (uint32_t*) (r->cq_ring + r->p.cq_off.head);
+	uint32_t *cq_tail = (uint32_t*) (r->cq_ring + r->p.cq_off.tail);
+
+	while(pending > 0) {
+		uint32_t head = *cq_head;
+		uint32_t end  = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+
+		if(head != end) {
+			pending -= end - head < pending ? end - head : pending;
+			__atomic_store_n(cq_head, end, __ATOMIC_RELEASE);
+			continue;
+		}
+
+		if(syscall(__NR_io_uring_enter, r->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR)
+			return 0;
+	}
+
+	return 1;
+}
+
+// Queues statx for every path and collects the results, up to a ring's
+// worth of requests per syscall
+static int StatRing(char **paths, size_t count, FileStat *out)
+{
+	Ring r;
+
+	if(!RingOpen(&r)) return 0;
+
+	uint32_t *sq_head  = (uint32_t*) (r.sq_ring + r.p.sq_off.head);
+	uint32_t *sq_tail  = (uint32_t*) (r.sq_ring + r.p.sq_off.tail);
+	uint32_t *sq_mask  = (uint32_t*) (r.sq_ring + r.p.sq_off.ring_mask);
+	uint32_t *sq_array = (uint32_t*) (r.sq_ring + r.p.sq_off.array);
+	uint32_t *cq_head  = (uint32_t*) (r.cq_ring + r.p.cq_off.head);
+	uint32_t *cq_tail  = (uint32_t*) (r.cq_ring + r.p.cq_off.tail);
+	uint32_t *cq_mask  = (uint32_t*) (r.cq_ring + r.p.cq_off.ring_mask);
+
+	struct io_uring_cqe *cqes = (struct io_uring_cqe*) (r.cq_ring + r.p.cq_off.cqes);
+
+	struct statx *bufs = malloc(r.p.sq_entries * sizeof(struct statx));
+
+	int ok = 1;
+
+	uint32_t pending = 0;
+
+	for(size_t done = 0; ok && done < count;) {
+		uint32_t batch = count - done < r.p.sq_entries ? count - done : r.p.sq_entries;
+		uint32_t tail  = *sq_tail;
+
+		for(uint32_t i = 0; i < batch; i++) {
+			uint32_t idx = (tail + i) & *sq_mask;
+
+			struct io_uring_sqe *sqe = &r.sqes[idx];
+			memset(sqe, 0, sizeof(*sqe));
+
+			sqe->opcode    = IORING_OP_STATX;
+			sqe->fd        = AT_FDCWD;
+			sqe->addr      = (uint64_t) (uintptr_t) paths[done + i];
+			sqe->len       = STATX_MTIME | STATX_SIZE | STATX_INO;
+			sqe->off       = (uint64_t) (uintptr_t) &bufs[i];
+			sqe->user_data = i;
+
+			sq_array[idx] = idx;
+		}
+
+		__atomic_store_n(sq_tail, tail + batch, __ATOMIC_RELEASE);
+
+		uint32_t reaped = 0;
+
+		while(reaped < batch) {
+			if(syscall(__NR_io_uring_enter, r.fd, reaped == 0 ? batch : 0, batch - reaped, IORING_ENTER_GETEVENTS, NULL, 0) < 0) {
+				if(errno == EINTR) continue;
+
+				// Requests the kernel already took from this batch are
+				// still running and write into bufs
+				pending = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) - tail - reaped;
+				ok = 0;
+				break;
+			}
+
+			uint32_t head = *cq_head;
+			uint32_t end  = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+
+			for(; head != end; head++, reaped++) {
+				struct io_uring_cqe *cqe = &cqes[head & *cq_mask];
+
+				size_t i = done + cqe->user_data;
+
+				if(cqe->res == 0)
+					out[i] = StatxInfo(&bufs[cqe->user_data]);
+				else if(cqe->res == -ENOENT || cqe->res == -ENOTDIR)
+					out[i] = (FileStat) { .mtime = -1 };
+				else
+					out[i] = StatOne(paths[i]);
+			}
+
+			__atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+		}
+
+		done += batch;
+	}
+
+	// Memory the kernel may still write to is leaked rather than reused
+	if(ok || RingDrain(&r, pending))
+		free(bufs);
+
+	RingClose(&r);
+
+	return ok;
+}
+
+typedef struct
+{
+	char     **paths;
+	size_t     count;
+	FileStat  *out;
+	size_t     first;
+	size_t     step;
+} StatJob;
+
+static void *StatWorker(void *arg)
+{
+	StatJob *job = arg;
+
+	for(size_t i = job->first; i < job->count; i += job->step)
+		job->out[i] = StatOne(job->paths[i]);
+
+	return NULL;
+}
+
+static void StatThreads(char **paths, size_t count, FileStat *out)
+{
+	long threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if(threads < 1 || count < STAT_THREAD_MIN)
+		threads = 1;
+
+	if(threads > 16)
+		threads = 16;
+
+	pthread_t tids[16];
+	StatJob   jobs[16];
+
+	// Every slice is set up before any thread starts
+	for(long t = 0; t < threads; t++)
+		jobs[t] = (StatJob) { paths, count, out, t, threads };
+
+	long started = 0;
+
+	for(long t = 1; t < threads; t++) {
+		if(pthread_create(&tids[t], NULL, StatWorker, &jobs[t]) != 0)
+			break;
+
+		started = t;
+	}
+
+	// Slices without a thread of their own are walked here
+	for(long t = started + 1; t < threads; t++)
+		StatWorker(&jobs[t]);
+
+	StatWorker(&jobs[0]);
+
+	for(long t = 1; t <= started; t++)
+		pthread_join(tids[t], NULL);
+}
+
+void StatFiles(char **paths, size_t count, FileStat *out)
+{
+	if(count == 0) return;
+
+	if(count > 1 && StatRing(paths, count, out))
+		return;
+
+	StatThreads(paths, count, out);
+}
+
+void StatMtimes(char **paths, size_t count, int64_t *mtimes)
+{
+	FileStat *out = malloc(count * sizeof(FileStat));
+
+	StatFiles(paths, count, out);
+
+	for(size_t i = 0; i < count; i++)
+		mtimes[i] = out[i].mtime;
+
+	free(out);
+}
@@ -2,94 +2,873 @@
 #include <G64/G64.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <stdio.h>
+#include <glob.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/resource.h>
 
-LexState **lexp = NULL;
+extern char **environ;
+
+_Thread_local GBuild *gb = NULL;
+
+_Thread_local Stats stats;
+
+int StatsPipe(int fds[2])
+{
+	if(pipe(fds) != 0) {
+		fds[0] = fds[1] = -1;
+		return -1;
+	}
+
+	fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+	fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+	fcntl(fds[0], F_SETFL, O_NONBLOCK);
+
+	return 0;
+}
+
+// Called by a child just before it exits, after it has collected the
+// counters of its own children. A record is smaller than PIPE_BUF, so
+// children writing at once don't mix their records
+void StatsSend(int fd)
+{
+	if(fd >= 0 && write(fd, &stats, sizeof(Stats)) < 0) {}
+}
+
+// Adds the records of the children that have exited so far
+void StatsCollect(int fd)
+{
+	Stats child;
+
+	while(fd >= 0 && read(fd, &child, sizeof(Stats)) == sizeof(Stats)) {
+		uint64_t *to   = (uint64_t*) &stats;
+		uint64_t *from = (uint64_t*) &child;
+
+		for(size_t i = 0; i < sizeof(Stats) / sizeof(uint64_t); i++)
+			to[i] += from[i];
+	}
+}
+
+void StatsPrint()
+{
+	struct rusage ru, children;
+
+	if(getrusage(RUSAGE_SELF, &ru) != 0)
+		ru.ru_maxrss = 0;
+
+	if(getrusage(RUSAGE_CHILDREN, &children) != 0)
+		children.ru_maxrss = 0;
+
+	printf("gbuild: stats: statements run      %lu\n", stats.statements);
+	printf("gbuild: stats: variable lookups    %lu\n", stats.var_lookups);
+	printf("gbuild: stats: variables declared  %lu\n", stats.var_news);
+	printf("gbuild: stats: stat calls          %lu\n", stats.stat_calls);
+	printf("gbuild: stats: directories scanned %lu\n", stats.dirs_scanned);
+	printf("gbuild: stats: entries scanned     %lu\n", stats.entries_scanned);
+	printf("gbuild: stats: processes spawned   %lu\n", stats.processes);
+	printf("gbuild: stats: string bytes        %lu\n", stats.string_bytes);
+	printf("gbuild: stats: peak RSS            %ld KiB\n", ru.ru_maxrss);
+	printf("gbuild: stats: largest child RSS   %ld KiB\n", children.ru_maxrss);
+}
+
+void *Grow(void *ptr, size_t *cap, size_t size)
+{
+	*cap = *cap == 0 ? 16 : *cap * 2;
+
+	ptr = realloc(ptr, *cap * size);
+
+	if(ptr == NULL) {
+		printf("gbuild: fatal error: Out of memory\n");
+		exit(1);
+	}
+
+	return ptr;
+}
+
+#define HASH_P1 0x9E3779B185EBCA87ULL
+#define HASH_P2 0xC2B2AE3D27D4EB4FULL
+#define HASH_P3 0x165667B19E3779F9ULL
+#define HASH_P4 0x85EBCA77C2B2AE63ULL
+#define HASH_P5 0x27D4EB2F165667C5ULL
+
+static inline uint64_t HashRotl(uint64_t x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t HashRound(uint64_t acc, uint64_t input)
+{
+	acc += input * HASH_P2;
+	acc  = HashRotl(acc, 31);
+	return acc * HASH_P1;
+}
+
+static inline uint64_t HashMerge(uint64_t acc, uint64_t val)
+{
+	acc ^= HashRound(0, val);
+	return acc * HASH_P1 + HASH_P4;
+}
+
+static inline uint64_t HashRead64(const uint8_t *p)
+{
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint32_t HashRead32(const uint8_t *p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+// XXH64: four independent lanes over 32 byte stripes, which the compiler
+// can keep in vector registers
+uint64_t Hash64(const uint8_t *data, size_t len)
+{
+	const uint8_t *p   = data;
+	const uint8_t *end = data + len;
+
+	uint64_t h;
+
+	if(len >= 32) {
+		uint64_t v1 = HASH_P1 + HASH_P2;
+		uint64_t v2 = HASH_P2;
+		uint64_t v3 = 0;
+		uint64_t v4 = -HASH_P1;
+
+		const uint8_t *limit = end - 32;
+
+		do {
+			v1 = HashRound(v1, HashRead64(p));
+			v2 = HashRound(v2, HashRead64(p + 8));
+			v3 = HashRound(v3, HashRead64(p + 16));
+			v4 = HashRound(v4, HashRead64(p + 24));
+			p += 32;
+		} while(p <= limit);
+
+		h = HashRotl(v1, 1) + HashRotl(v2, 7) + HashRotl(v3, 12) + HashRotl(v4, 18);
+		h = HashMerge(h, v1);
+		h = HashMerge(h, v2);
+		h = HashMerge(h, v3);
+		h = HashMerge(h, v4);
+	} else {
+		h = HASH_P5;
+	}
+
+	h += len;
+
+	for(; p + 8 <= end; p += 8) {
+		h ^= HashRound(0, HashRead64(p));
+		h  = HashRotl(h, 27) * HASH_P1 + HASH_P4;
+	}
+
+	if(p + 4 <= end) {
+		h ^= (uint64_t) HashRead32(p) * HASH_P1;
+		h  = HashRotl(h, 23) * HASH_P2 + HASH_P3;
+		p += 4;
+	}
+
+	for(; p < end; p++) {
+		h ^= *p * HASH_P5;
+		h  = HashRotl(h, 11) * HASH_P1;
+	}
+
+	h ^= h >> 33;
+	h *= HASH_P2;
+	h ^= h >> 29;
+	h *= HASH_P3;
+	h ^= h >> 32;
+
+	return h;
+}
+
+char *RunCapture(const char *cmd, size_t *len, int *status)
+{
+	stats.processes++;
+
+	int fds[2];
+
+	if(pipe(fds) != 0)
+		return NULL;
+
+	fflush(stdout);
+
+	pid_t pid = fork();
+
+	if(pid < 0) {
+		close(fds[0]);
+		close(fds[1]);
+		return NULL;
+	}
+
+	if(pid == 0) {
+		close(fds[0]);
+		dup2(fds[1], STDOUT_FILENO);
+		close(fds[1]);
+
+		execl("/bin/sh", "sh", "-c", cmd, (char*) NULL);
+		_exit(127);
+	}
+
+	close(fds[1]);
+
+	size_t cap  = 0;
+	char  *data = NULL;
+
+	*len = 0;
+
+	for(;;) {
+		if(cap - *len < 4096)
+			data = Grow(data, &cap, 1);
+
+		ssize_t n = read(fds[0], &data[*len], cap - *len - 1);
+
+		// A signal handled while reading isn't the end of the output
+		if(n < 0 && errno == EINTR) continue;
+
+		if(n <= 0) break;
+
+		*len += n;
+	}
+
+	close(fds[0]);
+
+	int ws = -1;
+
+	while(waitpid(pid, &ws, 0) < 0 && errno == EINTR);
+
+	*status     = WIFEXITED(ws) ? WEXITSTATUS(ws) : 1;
+	data[*len] = 0;
+
+	return data;
+}
+
+// Tools known to read arguments from an @file
+static const char *rsp_tools[] = {
+	"cc", "c++", "gcc", "g++", "clang", "clang++", "ar", "llvm-ar", "ld", "ld.lld",
+	"ld.gold", "ld.bfd", "lld"
+};
+
+static int RspTool(const char *word)
+{
+	const char *name = strrchr(word, '/');
+	name = name ? name + 1 : word;
+
+	for(size_t i = 0; i < sizeof(rsp_tools) / sizeof(rsp_tools[0]); i++) {
+		size_t len = strlen(rsp_tools[i]);
+		size_t nlen = strlen(name);
+
+		// clang-17, x86_64-linux-gnu-gcc
+		if(strncmp(name, rsp_tools[i], len) == 0) {
+			const char *rest = &name[len];
+
+			if(*rest == 0) return 1;
+			if(*rest == '-' && rest[1] >= '0' && rest[1] <= '9') return 1;
+		}
+
+		if(nlen > len && name[nlen - len - 1] == '-' && strcmp(&name[nlen - len], rsp_tools[i]) == 0)
+			return 1;
+	}
+
+	return 0;
+}
 
 typedef struct
 {
-	char  *vars[128];
-	size_t var_count;
-} Scope;
+	char  **args;
+	size_t  count;
+	size_t  cap;
+	size_t  bytes;
+} ArgList;
 
-static HashMap *variables = NULL;
+static void ArgAdd(ArgList *list, char *arg)
+{
+	if(list->count == list->cap)
+		list->args = Grow(list->args, &list->cap, sizeof(char*));
+
+	list->args[list->count++] = arg;
+	list->bytes += strlen(arg) + 1 + sizeof(char*);
+}
+
+static void ArgFree(ArgList *list)
+{
+	for(size_t i = 0; i < list->count; i++)
+		free(list->args[i]);
+
+	free(list->args);
+}
+
+// Splits a command into words the way sh would, expanding unquoted globs.
+// Returns 0 for anything that needs a real shell.
+static int SplitCommand(const char *cmd, ArgList *list)
+{
+	const char *p = cmd;
+
+	size_t cap = strlen(cmd) + 1;
+	char  *word = malloc(cap);
+
+	for(;;) {
+		while(*p == ' ' || *p == '\t') p++;
+		if(*p == 0) break;
+
+		size_t len = 0;
+		int pattern = 0;
+
+		while(*p != 0 && *p != ' ' && *p != '\t') {
+			char c = *p++;
+
+			if(c == '\'') {
+				while(*p != 0 && *p != '\'') word[len++] = *p++;
+				if(*p++ == 0) goto shell;
+			} else if(c == '"') {
+				while(*p != 0 && *p != '"') {
+					if(*p == '$' || *p == '`') goto shell;
+					if(*p == '\\' && p[1] != 0 && strchr("\"\\$`", p[1])) p++;
+					word[len++] = *p++;
+				}
+				if(*p++ == 0) goto shell;
+			} else if(c == '\\') {
+				if(*p == 0) goto shell;
+				word[len++] = *p++;
+			} else if(strchr("|&;<>()$`\n~{}", c)) {
+				goto shell;
+			} else {
+				if(c == '*' || c == '?' || c == '[') pattern = 1;
+				word[len++] = c;
+			}
+		}
+
+		word[len] = 0;
+
+		glob_t g;
+
+		if(pattern && glob(word, 0, NULL, &g) == 0) {
+			for(size_t i = 0; i < g.gl_pathc; i++)
+				ArgAdd(list, strdup(g.gl_pathv[i]));
+
+			globfree(&g);
+		} else {
+			ArgAdd(list, strdup(word));
+		}
+	}
+
+	free(word);
+	return list->count > 0;
+
+shell:
+	free(word);
+	return 0;
+}
+
+static int WriteRsp(ArgList *list, char *path)
+{
+	int fd = mkstemps(path, 4);
+	if(fd < 0) return 0;
+
+	FILE *f = fdopen(fd, "w");
+
+	for(size_t i = 1; i < list->count; i++) {
+		for(char *c = list->args[i]; *c; c++) {
+			if(strchr(" \t\n'\"\\", *c))
+				fputc('\\', f);
+			fputc(*c, f);
+		}
+
+		fputc('\n', f);
+	}
+
+	return fclose(f) == 0;
+}
+
+// Runs a command like system(), but when a compiler, archiver or linker
+// line would be too long for exec, the arguments go into an @rsp file and
+// the tool is started directly
+int RunCommand(const char *cmd)
+{
+	stats.processes++;
+
+	size_t len = strlen(cmd);
+
+	const char *end = cmd + strcspn(cmd, " \t");
+
+	char *tool = strndup(cmd, end - cmd);
+	int   known = RspTool(tool);
+
+	free(tool);
+
+	if(!known)
+		return system(cmd);
+
+	ArgList list = { 0 };
+
+	if(!SplitCommand(cmd, &list)) {
+		ArgFree(&list);
+		return system(cmd);
+	}
+
+	long arg_max = sysconf(_SC_ARG_MAX);
+
+	if(arg_max <= 0 || arg_max > 1 << 21)
+		arg_max = 1 << 21;
+
+	size_t env_bytes = 0;
+
+	for(char **env = environ; *env != NULL; env++)
+		env_bytes += strlen(*env) + 1 + sizeof(char*);
+
+	// A single argument (the whole line handed to sh -c) is capped at
+	// MAX_ARG_STRLEN, the expanded list by ARG_MAX
+	if(len < 128 * 1024 - 1 && list.bytes + env_bytes + 4096 < (size_t) arg_max) {
+		ArgFree(&list);
+		return system(cmd);
+	}
+
+	char rsp[] = "/tmp/gbuild-XXXXXX.rsp";
+
+	if(!WriteRsp(&list, rsp)) {
+		ArgFree(&list);
+		return system(cmd);
+	}
+
+	char *at = malloc(strlen(rsp) + 2);
+
+	at[0] = '@';
+	strcpy(&at[1], rsp);
 
-static Scope scopes[256] = { 0 };
+	fflush(stdout);
 
-static size_t scope_top = 0;
+	int   ws  = -1;
+	pid_t pid = fork();
+
+	if(pid == 0) {
+		char *argv[] = { list.args[0], at, NULL };
+
+		execvp(argv[0], argv);
+		_exit(127);
+	}
+
+	if(pid > 0)
+		while(waitpid(pid, &ws, 0) < 0 && errno == EINTR);
+
+	unlink(rsp);
+
+	free(at);
+	ArgFree(&list);
+
+	return ws;
+}
+
+static void VariableRehash()
+{
+	VarTable *vt = &gb->vars;
+
+	HashMap *map = HashMapNew(vt->buckets * 2, HashDefaultFunction);
+
+	for(size_t i = 0; i < vt->scope_top; i++) {
+		Scope *sc = &vt->scopes[i];
+
+		for(size_t j = 0; j < sc->var_count; j++) {
+			Variable *var = sc->vars[j];
+			HashPut(map, (uint8_t*) var->name, strlen(var->name), var);
+		}
+	}
+
+	HashMapDelete(vt->map);
+
+	vt->map      = map;
+	vt->buckets *= 2;
+}
+
+static void VarTableFree(VarTable *vt)
+{
+	for(size_t i = 0; i < vt->scope_cap; i++) {
+		free(vt->scopes[i].vars);
+		free(vt->scopes[i].functions);
+	}
+
+	free(vt->scopes);
+
+	if(vt->map != NULL)
+		HashMapDelete(vt->map);
+
+	if(vt->functions != NULL)
+		HashMapDelete(vt->functions);
+}
+
+struct Frame
+{
+	VarTable vars;
+};
+
+Frame *FramePush()
+{
+	Frame *frame = malloc(sizeof(Frame));
+
+	frame->vars = gb->vars;
+	gb->vars    = (VarTable) { 0 };
+
+	ScopePush();
+
+	return frame;
+}
+
+void FramePop(Frame *frame)
+{
+	VarTableFree(&gb->vars);
+
+	gb->vars = frame->vars;
+
+	free(frame);
+}
+
+void DeclareArgs(int argc, char **argv)
+{
+	for(int i = 0; i < argc; i++) {
+		Variable *var = calloc(1, sizeof(Variable));
+
+		StringBuilder *builder = StringBuilderNew();
+
+		StringBuilderAppend(builder, "arg%d", i);
+
+		var->name = StringBuild(builder);
+
+		StringBuilderDelete(builder);
+
+		var->value = ValueString(argv[i], strlen(argv[i]));
+
+		VariableNew(var);
+	}
+
+	Variable *var = calloc(1, sizeof(Variable));
+
+	var->name          = strdup("argc");
+	var->value.type    = VT_INT;
+	var->value.cur_int = argc;
+
+	VariableNew(var);
+}
+
+void DeclareVariant()
+{
+	Variant *v = gb->variant;
+
+	if(v == NULL) return;
+
+	for(size_t i = 0; i < v->count; i++) {
+		Variable *var = calloc(1, sizeof(Variable));
+
+		var->name  = v->keys[i];
+		var->value = ValueString(v->values[i], strlen(v->values[i]));
+
+		VariableNew(var);
+	}
+}
+
+const char *VariantValue(const char *name)
+{
+	Variant *v = gb->variant;
+
+	if(v == NULL) return NULL;
+
+	for(size_t i = 0; i < v->count; i++) {
+		if(strcmp(v->keys[i], name) == 0)
+			return v->values[i];
+	}
+
+	return NULL;
+}
+
+// Files a run keeps between runs are kept apart for each variant
+const char *VariantPath(const char *file)
+{
+	static _Thread_local char path[256];
+
+	if(gb->variant == NULL)
+		return file;
+
+	snprintf(path, sizeof(path), "%s.%s", file, gb->variant->name);
+
+	return path;
+}
 
 void ScopePush()
 {
-	if(variables == NULL)
-		variables = HashMapNew(1024, HashDefaultFunction);
-	scopes[scope_top++] = (Scope) { { NULL }, 0 };
+	VarTable *vt = &gb->vars;
+
+	if(vt->map == NULL) {
+		vt->buckets = 1024;
+		vt->map     = HashMapNew(vt->buckets, HashDefaultFunction);
+	}
+
+	if(vt->scope_top == vt->scope_cap) {
+		size_t old = vt->scope_cap;
+		vt->scopes = Grow(vt->scopes, &vt->scope_cap, sizeof(Scope));
+		memset(&vt->scopes[old], 0, (vt->scope_cap - old) * sizeof(Scope));
+	}
+
+	vt->scopes[vt->scope_top].var_count      = 0;
+	vt->scopes[vt->scope_top].function_count = 0;
+
+	vt->scope_top++;
 }
 
 void ScopePop()
 {
-	Scope sc = scopes[--scope_top];
+	VarTable *vt = &gb->vars;
+
+	Scope *sc = &vt->scopes[--vt->scope_top];
 
-	for(size_t i = 0; i < sc.var_count; i++) {
-		Variable *var = HashFind(variables, (uint8_t*) sc.vars[i], strlen(sc.vars[i]));
+	for(size_t i = 0; i < sc->var_count; i++) {
+		char *name = sc->vars[i]->name;
+
+		Variable *var = HashFind(vt->map, (uint8_t*) name, strlen(name));
 		if(var == NULL) continue;
 
-		HashDelete(variables, (uint8_t*) sc.vars[i], strlen(sc.vars[i]));
+		HashDelete(vt->map, (uint8_t*) name, strlen(name));
+	}
+
+	vt->total -= sc->var_count;
+
+	// Functions live until the end of the block they're defined in
+	for(size_t i = 0; i < sc->function_count; i++) {
+		char *name = sc->functions[i];
+
+		HashDelete(vt->functions, (uint8_t*) name, strlen(name));
 	}
 }
 
 void VariableNew(Variable *var)
 {
-	Scope *sc = &scopes[scope_top - 1];
+	VarTable *vt = &gb->vars;
 
-	sc->vars[sc->var_count++] = var->name;
-	HashPut(variables, (uint8_t*) var->name, strlen(var->name), var);
+	Scope *sc = &vt->scopes[vt->scope_top - 1];
+
+	if(sc->var_count == sc->var_cap)
+		sc->vars = Grow(sc->vars, &sc->var_cap, sizeof(Variable*));
+
+	stats.var_news++;
+
+	sc->vars[sc->var_count++] = var;
+	HashPut(vt->map, (uint8_t*) var->name, strlen(var->name), var);
+
+	if(++vt->total > vt->buckets)
+		VariableRehash();
+}
+
+void FunctionNew(char *name, void *fn)
+{
+	VarTable *vt = &gb->vars;
+
+	Scope *sc = &vt->scopes[vt->scope_top - 1];
+
+	if(vt->functions == NULL)
+		vt->functions = HashMapNew(64, HashDefaultFunction);
+
+	if(sc->function_count == sc->function_cap)
+		sc->functions = Grow(sc->functions, &sc->function_cap, sizeof(char*));
+
+	sc->functions[sc->function_count++] = name;
+	HashPut(vt->functions, (uint8_t*) name, strlen(name), fn);
 }
 
 Variable *VariableGet(const char *name)
 {
-	return HashFind(variables, (uint8_t*) name, strlen(name));
+	stats.var_lookups++;
+
+	return HashFind(gb->vars.map, (uint8_t*) name, strlen(name));
+}
+
+// Makes a variable that was shadowed in an inner scope visible again
+void VariableRestore(Variable *var)
+{
+	HashPut(gb->vars.map, (uint8_t*) var->name, strlen(var->name), var);
 }
 
+// The values of every variable of the current frame, in scope order. A
+// block pops what it declares, so after one the same variables are there
+Value *VariablesSave(size_t *count)
+{
+	VarTable *vt = &gb->vars;
 
-static uint8_t ws_stack[128] = { 0 };
+	*count = 0;
 
-static uint8_t ws_top = 0;
+	for(size_t i = 0; i < vt->scope_top; i++)
+		*count += vt->scopes[i].var_count;
 
-void WSPush()
+	Value *saved = malloc((*count + 1) * sizeof(Value));
+	Value *val   = saved;
+
+	for(size_t i = 0; i < vt->scope_top; i++) {
+		for(size_t j = 0; j < vt->scopes[i].var_count; j++)
+			*val++ = vt->scopes[i].vars[j]->value;
+	}
+
+	return saved;
+}
+
+void VariablesRestore(Value *saved)
 {
-	ws_stack[ws_top++] = lex->skip_ws;
+	VarTable *vt = &gb->vars;
+
+	for(size_t i = 0; i < vt->scope_top; i++) {
+		for(size_t j = 0; j < vt->scopes[i].var_count; j++)
+			vt->scopes[i].vars[j]->value = *saved++;
+	}
 }
 
-void WSPop()
+// Variables that have another type in other become unknown
+void VariablesJoin(Value *other)
 {
-	lex->skip_ws = ws_stack[--ws_top];
+	VarTable *vt = &gb->vars;
+
+	for(size_t i = 0; i < vt->scope_top; i++) {
+		for(size_t j = 0; j < vt->scopes[i].var_count; j++) {
+			Variable *var = vt->scopes[i].vars[j];
+
+			if(var->value.type != (other++)->type)
+				var->value = (Value) { .type = VT_UNKNOWN };
+		}
+	}
 }
 
-static Value val_stack[1024] = { 0 };
 
-static size_t val_top = 0;
+typedef struct
+{
+	int       line;
+	LexState *end;
+} Brace;
 
-void PushVal(Value *val)
+struct BraceTable
 {
-	if(val_top == 1024) {
-		printf("gbuild: fatal error: Stack size exceeded\n");
-		exit(1);
+	// The source position of each '{' to an index + 1 into list
+	HashMap   *map;
+	Brace     *list;
+	size_t     count;
+	size_t     cap;
+
+	// The '{' not closed yet while building
+	LexState **open;
+	size_t     open_count;
+	size_t     open_cap;
+
+	// The states read while building, which the ends point into
+	LexState  *chain;
+};
+
+BraceTable *BraceTableNew()
+{
+	BraceTable *table = calloc(1, sizeof(BraceTable));
+
+	table->map = HashMapNew(1024, HashDefaultFunction);
+
+	return table;
+}
+
+// Fills the table as it goes, so a lexical error part way leaves a table
+// that can still be freed
+void BraceTableBuild(BraceTable *table, LexState *state)
+{
+	LexState *l = LexStateNew();
+	memcpy(l, state, sizeof(LexState));
+
+	table->chain = l;
+
+	for(;;) {
+		int64_t tok = LexPush(&l);
+
+		if(tok == TK_EOF) break;
+
+		if(tok == TK_LEFT_CURLY) {
+			if(table->open_count == table->open_cap)
+				table->open = Grow(table->open, &table->open_cap, sizeof(LexState*));
+
+			table->open[table->open_count++] = l;
+		} else if(tok == TK_RIGHT_CURLY && table->open_count > 0) {
+			LexState *start = table->open[--table->open_count];
+
+			if(table->count == table->cap)
+				table->list = Grow(table->list, &table->cap, sizeof(Brace));
+
+			table->list[table->count++] = (Brace) { start->line, l };
+
+			HashPut(table->map, (uint8_t*) &start->source, sizeof(start->source), (void*) (uintptr_t) table->count);
+		}
 	}
-	val_stack[val_top++] = *val;
+
+	free(table->open);
+
+	table->open       = NULL;
+	table->open_count = 0;
+	table->open_cap   = 0;
+}
+
+void BraceTableFree(BraceTable *table)
+{
+	HashMapDelete(table->map);
+	LexStateDelete(table->chain);
+
+	free(table->list);
+	free(table->open);
+	free(table);
+}
+
+int BraceSkip()
+{
+	if(gb->module == NULL) return 0;
+
+	BraceTable *table = gb->module->braces;
+
+	size_t idx = (uintptr_t) HashFind(table->map, (uint8_t*) &lex->source, sizeof(lex->source));
+	if(idx == 0) return 0;
+
+	Brace *b = &table->list[idx - 1];
+	if(b->line != lex->line) return 0;
+
+	lex = LexStateNew();
+	memcpy(lex, b->end, sizeof(LexState));
+
+	return 1;
+}
+
+
+void WSPush()
+{
+	if(gb->ws_top == gb->ws_cap)
+		gb->ws_stack = Grow(gb->ws_stack, &gb->ws_cap, sizeof(uint8_t));
+
+	gb->ws_stack[gb->ws_top++] = lex->skip_ws;
+}
+
+void WSPop()
+{
+	lex->skip_ws = gb->ws_stack[--gb->ws_top];
+}
+
+void PushVal(Value *val)
+{
+	if(gb->val_top == gb->val_cap)
+		gb->val_stack = Grow(gb->val_stack, &gb->val_cap, sizeof(Value));
+
+	gb->val_stack[gb->val_top++] = *val;
 }
 
 Value PopVal()
 {
-	if(val_top == 0) {
+	if(gb->val_top == 0) {
 		printf("gbuild: fatal error: Stack underflow\n");
-		exit(1);
+		ScriptExit(1);
 	}
-	return val_stack[--val_top];
+	return gb->val_stack[--gb->val_top];
 }
 
 Value PeekVal()
 {
-	return val_stack[val_top - 1];
+	return gb->val_stack[gb->val_top - 1];
 }
 
 double ValueNum(Value *val)
@@ -98,6 +877,61 @@ double ValueNum(Value *val)
 	return val->type == VT_INT ? (double) val->cur_int : val->cur_float;
 }
 
+// str_len is 32 bits, longer strings from files or commands are an error
+// rather than silently cut short
+static void StringLenCheck(size_t len)
+{
+	if(len > UINT32_MAX) {
+		printf("gbuild: fatal error: String of %zu bytes is too long\n", len);
+		ScriptExit(1);
+	}
+}
+
+Value ValueString(char *str, size_t len)
+{
+	StringLenCheck(len);
+
+	Value val = { .type = VT_STRING, .str_len = len };
+
+	if(len <= VALUE_INLINE_LEN) {
+		memcpy(val.inline_str, str, len);
+		val.inline_str[len] = 0;
+	} else {
+		val.cur_str = str;
+	}
+
+	return val;
+}
+
+char *ValueStr(Value *val)
+{
+	return val->str_len <= VALUE_INLINE_LEN ? val->inline_str : val->cur_str;
+}
+
+char *ValueText(Value *val, char *num, size_t *len)
+{
+	switch(val->type)
+	{
+	case VT_INT:   *len = snprintf(num, VALUE_TEXT_LEN, "%ld", val->cur_int);  return num;
+	case VT_FLOAT: *len = snprintf(num, VALUE_TEXT_LEN, "%f", val->cur_float); return num;
+	}
+
+	*len = val->str_len;
+	return ValueStr(val);
+}
+
+// Like ValueText, but floats are printed exactly so that distinct values
+// never share a memo key
+char *ValueKeyText(Value *val, char *num, size_t *len)
+{
+	if(val->type == VT_FLOAT) {
+		*len = snprintf(num, VALUE_TEXT_LEN, "%a", val->cur_float);
+		return num;
+	}
+
+	return ValueText(val, num, len);
+}
+
 void PushInt(int64_t num)
 {
 	PushVal(&(Value) { .type = VT_INT, .cur_int = num });
@@ -108,7 +942,7 @@ int64_t PopInt()
 	Value v = PopVal();
 	if(v.type != VT_INT) {
 		printf("gbuild: fatal error: Expected integer on the stack\n");
-		exit(1);
+		ScriptExit(1);
 	}
 
 	return v.cur_int;
@@ -124,7 +958,7 @@ double PopFloat()
 	Value v = PopVal();
 	if(v.type != VT_FLOAT) {
 		printf("gbuild: fatal error: Expected float on the stack\n");
-		exit(1);
+		ScriptExit(1);
 	}
 
 	return v.cur_float;
@@ -132,7 +966,45 @@ double PopFloat()
 
 void PushString(char *str)
 {
-	PushVal(&(Value) { .type = VT_STRING, .cur_str = str, .str_len = strlen(str) });
+	Value val = ValueString(str, strlen(str));
+	PushVal(&val);
+}
+
+// A string value that doesn't point into str
+Value ValueStringCopy(const char *str, size_t len)
+{
+	StringLenCheck(len);
+
+	if(len <= VALUE_INLINE_LEN)
+		return ValueString((char*) str, len);
+
+	char *nstr = malloc(len + 1);
+	memcpy(nstr, str, len);
+	nstr[len] = 0;
+
+	return ValueStringOwn(nstr, len);
+}
+
+// A string value for str, which was allocated for it; short strings are
+// copied into the value and str is left to the caller
+Value ValueStringOwn(char *str, size_t len)
+{
+	if(len > VALUE_INLINE_LEN)
+		stats.string_bytes += len + 1;
+
+	return ValueString(str, len);
+}
+
+void PushStringCopy(const char *str, size_t len)
+{
+	Value val = ValueStringCopy(str, len);
+	PushVal(&val);
+}
+
+void PushStringOwn(char *str, size_t len)
+{
+	Value val = ValueStringOwn(str, len);
+	PushVal(&val);
 }
 
 char *PopString()
@@ -140,15 +1012,18 @@ char *PopString()
 	Value v = PopVal();
 	if(v.type != VT_STRING) {
 		printf("gbuild: fatal error: Expected string on the stack\n");
-		exit(1);
+		ScriptExit(1);
 	}
 
+	if(v.str_len <= VALUE_INLINE_LEN)
+		return strdup(v.inline_str);
+
 	return v.cur_str;
 }
 
 void ClearVal()
 {
-	val_top = 0;
+	gb->val_top = gb->val_base;
 }
 
 void Expect(int64_t token)
@@ -158,7 +1033,7 @@ void Expect(int64_t token)
 		const char *n1 = GetTokenName(token);
 		const char *n2 = GetTokenName(tok);
 		printf("GBuildFile:%d: error: Expected %s, got %s\n", lex->line, n1, n2);
-		exit(1);
+		ScriptExit(1);
 	}
 }
 
@@ -167,7 +1042,7 @@ void ExpectIdent(const char *str)
 	Expect(TK_IDENT);
 	if(strcmp(str, lexl->cur_str) != 0) {
 		printf("GBuildFile:%d: error: Expected identifier '%s', got '%s'\n", lex->line, str, lexl->cur_str);
-		exit(1);
+		ScriptExit(1);
 	}
 }
 
@@ -220,3 +1095,102 @@ int AcceptIdentB(const char *str)
 
 	return r;
 }
+
+GBuild *GBuildNew()
+{
+	GBuild *ctx = calloc(1, sizeof(GBuild));
+
+	ctx->check      = 1;
+	ctx->journal_fd = -1;
+
+	return ctx;
+}
+
+void GBuildDelete(GBuild *ctx)
+{
+	VarTableFree(&ctx->vars);
+
+	if(ctx->modules != NULL)
+		HashMapDelete(ctx->modules);
+
+	if(ctx->file_lists != NULL)
+		HashMapDelete(ctx->file_lists);
+
+	for(size_t i = 0; i < ctx->variant_count; i++) {
+		Variant *v = &ctx->variants[i];
+
+		for(size_t j = 0; j < v->count; j++) {
+			free(v->keys[j]);
+			free(v->values[j]);
+		}
+
+		free(v->name);
+		free(v->keys);
+		free(v->values);
+	}
+
+	free(ctx->variants);
+
+	free(ctx->ws_stack);
+	free(ctx->val_stack);
+	free(ctx);
+}
+
+void GBuildSetDryRun(GBuild *ctx, int dry_run)
+{
+	ctx->dry_run = dry_run;
+}
+
+void GBuildSetCheck(GBuild *ctx, int check)
+{
+	ctx->check = check;
+}
+
+void GBuildSetResume(GBuild *ctx, int resume)
+{
+	ctx->resume = resume;
+}
+
+void GBuildAddVariant(GBuild *ctx, const char *name)
+{
+	if(ctx->variant_count == ctx->variant_cap)
+		ctx->variants = Grow(ctx->variants, &ctx->variant_cap, sizeof(Variant));
+
+	Variant *v = &ctx->variants[ctx->variant_count++];
+
+	memset(v, 0, sizeof(Variant));
+
+	v->name = strdup(name);
+
+	char *outdir = malloc(strlen(name) + 7);
+	sprintf(outdir, "build/%s", name);
+
+	GBuildSetVariantValue(ctx, "variant", name);
+	GBuildSetVariantValue(ctx, "outdir", outdir);
+
+	free(outdir);
+}
+
+void GBuildSetVariantValue(GBuild *ctx, const char *key, const char *value)
+{
+	if(ctx->variant_count == 0) return;
+
+	Variant *v = &ctx->variants[ctx->variant_count - 1];
+
+	for(size_t i = 0; i < v->count; i++) {
+		if(strcmp(v->keys[i], key) == 0) {
+			free(v->values[i]);
+			v->values[i] = strdup(value);
+			return;
+		}
+	}
+
+	if(v->count == v->cap) {
+		size_t cap = v->cap;
+		v->keys   = Grow(v->keys, &cap, sizeof(char*));
+		v->values = Grow(v->values, &v->cap, sizeof(char*));
+	}
+
+	v->keys[v->count]     = strdup(key);
+	v->values[v->count++] = strdup(value);
+}
@@ -1 +1,4 @@
-clang GBuild.c GBuildUtil.c -lG64 -lm -g -o gbuild
+clang GBuildMain.c GBuild.c GBuildUtil.c GBuildFS.c GBuildMemo.c GBuildModule.c GBuildRemote.c GBuildStat.c GBuildJournal.c GBuildSnapshot.c GBuildServer.c -lG64 -lm -lpthread -g -o gbuild
+clang -c -g GBuild.c GBuildUtil.c GBuildFS.c GBuildMemo.c GBuildModule.c GBuildRemote.c GBuildStat.c GBuildJournal.c GBuildSnapshot.c
+ar rcs libgbuild.a GBuild.o GBuildUtil.o GBuildFS.o GBuildMemo.o GBuildModule.o GBuildRemote.o GBuildStat.o GBuildJournal.o GBuildSnapshot.o
+rm -f GBuild*.o
@@ -0,0 +1,30 @@
+#!/bin/sh
+# Runs each tests/*.gb as the GBuildFile of an empty directory and compares
+# its output and exit status with tests/<name>.expected. Files under
+# tests/<name>.d are copied into the directory first. GBUILD names the
+# binary under test, ./gbuild by default.
+
+cd "$(dirname "$0")" || exit 1
+
+gbuild=$(realpath "${GBUILD:-../gbuild}")
+failed=0
+
+for test in *.gb; do
+	name=${test%.gb}
+	dir=$(mktemp -d)
+
+	[ -d "$name.d" ] && cp -R "$name.d/." "$dir"
+	cp "$test" "$dir/GBuildFile"
+	(cd "$dir" && "$gbuild" > out 2>&1; echo "exit $?" >> out)
+
+	if diff -u "$name.expected" "$dir/out"; then
+		echo "PASS $name"
+	else
+		echo "FAIL $name"
+		failed=1
+	fi
+
+	rm -rf "$dir"
+done
+
+exit $failed